@@ -16,8 +16,15 @@
 #define _COMMON_H_
 
 #include <cmath>
+#include <algorithm>
+#include <cstdarg>
 #include <string>
+#include <unordered_map>
 #include <ctime>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #ifdef _WIN32
 #include <direct.h>
@@ -35,6 +42,7 @@
 using namespace std;
 
 #include "MSReader.h"
+#include "mzParser.h"
 #include "Spectrum.h"
 #include "MSObject.h"
 #include <vector>
@@ -0,0 +1,595 @@
+/*
+   Copyright 2017 University of Washington                          3-clause BSD license
+
+   Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+   3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//  Test of the fast xcorr kernels.  Runs the scalar, SSE2 and AVX windowed mean
+//  and flanking peak kernels against the original bounds-checked loops on
+//  binned spectra and on edge case array sizes, in double and float.
+//
+//  make test
+//  ./fastxcorr-test [spectra.ms2 ...]
+//
+//  Without arguments synthetic peptide spectra are used; .ms2 files given on
+//  the command line are binned and tested as well.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "Common.h"
+#include "mango_DataInternal.h"
+#include "mango_FastXcorr.h"
+
+#define TEST_BIN_WIDTH        0.02
+#define TEST_BIN_OFFSET       1.0         // 1 - fragment_bin_offset
+#define TEST_XCORR_OFFSET     75          // iXcorrProcessingOffset
+#define TEST_NUM_SPECTRA      200
+#define TEST_TOL_DOUBLE       1.0E-9
+#define TEST_TOL_FLOAT        1.0E-4
+
+static const char *szKernelName[] = { "scalar", "sse2", "avx" };
+
+struct BinnedSpectrum
+{
+   string sName;
+   vector<double> vdCorr;     // MakeCorrData output
+};
+
+static int iNumFailures = 0;
+
+
+static uint64_t lSeed = 88172645463325252ULL;
+
+static uint64_t NextRandom()
+{
+   lSeed ^= lSeed << 13;
+   lSeed ^= lSeed >> 7;
+   lSeed ^= lSeed << 17;
+   return lSeed;
+}
+
+static double RandomUnit()
+{
+   return (double)(NextRandom() >> 11) / 9007199254740992.0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Original loops, as in mango_preprocess::Preprocess before the kernels.  The
+//  input must be zero padded by iOffset bins as the first loop reads past a
+//  spectrum shorter than the window.
+///////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+static void OldWindowedMean(const T *pdTmpCorrelationData,
+                            T *pdTmpFastXcorrData,
+                            int iArraySize,
+                            int iOffset)
+{
+   int i;
+   double dSum = 0.0;
+   int iTmpRange = 2*iOffset + 1;
+   double dTmp = 1.0 / (double)(iTmpRange - 1);
+
+   for (i=0; i<iOffset; i++)
+      dSum += pdTmpCorrelationData[i];
+   for (i=iOffset; i < iArraySize + iOffset; i++)
+   {
+      if (i<iArraySize)
+         dSum += pdTmpCorrelationData[i];
+      if (i>=iTmpRange && i-iTmpRange < iArraySize)
+         dSum -= pdTmpCorrelationData[i-iTmpRange];
+      if (i-iOffset >=0 && i-iOffset < iArraySize)
+         pdTmpFastXcorrData[i-iOffset] = (dSum - pdTmpCorrelationData[i-iOffset])* dTmp;
+   }
+}
+
+template <typename T>
+static void OldFastXcorrData(const T *pdTmpCorrelationData,
+                             const T *pdTmpFastXcorrData,
+                             float *pfFastXcorrData,
+                             int iArraySize,
+                             bool bFlanking)
+{
+   int i;
+
+   pfFastXcorrData[0] = 0.0;
+   for (i=1; i<iArraySize; i++)
+   {
+      double dTmp = pdTmpCorrelationData[i] - pdTmpFastXcorrData[i];
+
+      pfFastXcorrData[i] = (float)dTmp;
+
+      if (bFlanking)
+      {
+         int iTmp;
+
+         iTmp = i-1;
+         pfFastXcorrData[i] += (float) ((pdTmpCorrelationData[iTmp] - pdTmpFastXcorrData[iTmp])*0.5);
+
+         iTmp = i+1;
+         if (iTmp < iArraySize)
+            pfFastXcorrData[i] += (float) ((pdTmpCorrelationData[iTmp] - pdTmpFastXcorrData[iTmp])*0.5);
+      }
+   }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Spectra
+///////////////////////////////////////////////////////////////////////////////
+
+// Bins peaks the way LoadIons and MakeCorrData do: sqrt intensity, highest peak
+// per bin, then 10 windows each scaled to 50 with peaks under 5% of the
+// spectrum's base peak dropped.
+static void BinSpectrum(const vector<pair<double,double> > &vPeaks,
+                        double dPrecursorMH,
+                        BinnedSpectrum &spec)
+{
+   int iArraySize = (int)((dPrecursorMH + 100.0) / TEST_BIN_WIDTH);
+   vector<double> vdRaw(iArraySize, 0.0);
+   int iHighestIon = 0;
+   double dHighestIntensity = 0.0;
+   size_t i;
+   int j;
+   int ii;
+
+   spec.vdCorr.assign(iArraySize, 0.0);
+
+   for (i=0; i<vPeaks.size(); i++)
+   {
+      double dMZ = vPeaks[i].first;
+      double dIntensity = sqrt(vPeaks[i].second);
+      int iBin = (int)(dMZ/TEST_BIN_WIDTH + TEST_BIN_OFFSET);
+
+      if (dMZ >= dPrecursorMH + 50.0 || iBin >= iArraySize || iBin < 0 || dIntensity <= 0.0)
+         continue;
+
+      if (dIntensity > vdRaw[iBin])
+         vdRaw[iBin] = dIntensity;
+      if (iBin > iHighestIon)
+         iHighestIon = iBin;
+      if (vdRaw[iBin] > dHighestIntensity)
+         dHighestIntensity = vdRaw[iBin];
+   }
+
+   int iWindowSize = iHighestIon/10 + 1;
+
+   for (j=0; j<10; j++)
+   {
+      double dMaxWindowInten = 0.0;
+
+      for (ii=0; ii<iWindowSize; ii++)
+      {
+         int iBin = j*iWindowSize + ii;
+         if (iBin < iArraySize && vdRaw[iBin] > dMaxWindowInten)
+            dMaxWindowInten = vdRaw[iBin];
+      }
+
+      if (dMaxWindowInten > 0.0)
+      {
+         double dTmp1 = 50.0 / dMaxWindowInten;
+         double dTmp2 = 0.05 * dHighestIntensity;
+
+         for (ii=0; ii<iWindowSize; ii++)
+         {
+            int iBin = j*iWindowSize + ii;
+            if (iBin < iArraySize && vdRaw[iBin] > dTmp2)
+               spec.vdCorr[iBin] = vdRaw[iBin]*dTmp1;
+         }
+      }
+   }
+}
+
+
+// Tryptic-like peptides with b and y ions (1+ and 2+), their isotope peaks and
+// low level noise across the mass range.
+static void MakeSyntheticSpectra(int iNumSpectra,
+                                 vector<BinnedSpectrum> &vSpectra)
+{
+   static const double pdResidue[] = { 57.02146, 71.03711, 87.03203, 97.05276, 99.06841, 101.04768,
+      103.00919, 113.08406, 114.04293, 115.02694, 128.05858, 128.09496, 129.04259, 131.04049,
+      137.05891, 147.06841, 156.10111, 163.06333, 186.07931 };
+   int iNumResidues = (int)(sizeof(pdResidue)/sizeof(double));
+   int i;
+   int ii;
+
+   for (i=0; i<iNumSpectra; i++)
+   {
+      int iLength = 6 + (int)(NextRandom() % 40);
+      vector<double> vdMass;
+      vector<pair<double,double> > vPeaks;
+      double dPeptide = 18.010565;
+      BinnedSpectrum spec;
+      char szName[64];
+
+      for (ii=0; ii<iLength; ii++)
+      {
+         vdMass.push_back(pdResidue[NextRandom() % iNumResidues]);
+         dPeptide += vdMass.back();
+      }
+      // cleavable ends on K or R
+      vdMass.back() = (NextRandom() & 1 ? 128.09496 : 156.10111);
+
+      double dB = 1.007276;
+      for (ii=0; ii<iLength-1; ii++)
+      {
+         dB += vdMass[ii];
+         double dY = dPeptide + 2.0*1.007276 - dB;
+         double dInten = 1000.0 + 1.0E6*RandomUnit();
+
+         vPeaks.push_back(make_pair(dB, dInten*RandomUnit()));
+         vPeaks.push_back(make_pair(dY, dInten));
+         vPeaks.push_back(make_pair(dY + 1.003355, 0.5*dInten));
+         vPeaks.push_back(make_pair((dB + 1.007276)/2.0, 0.2*dInten*RandomUnit()));
+         vPeaks.push_back(make_pair((dY + 1.007276)/2.0, 0.2*dInten*RandomUnit()));
+      }
+
+      int iNumNoise = 50 + (int)(NextRandom() % 400);
+      for (ii=0; ii<iNumNoise; ii++)
+         vPeaks.push_back(make_pair(100.0 + (dPeptide - 50.0)*RandomUnit(), 5.0E4*RandomUnit()));
+
+      sprintf(szName, "synthetic %d (%0.2f Da)", i, dPeptide);
+      spec.sName = szName;
+      BinSpectrum(vPeaks, dPeptide + 1.007276, spec);
+      vSpectra.push_back(spec);
+   }
+}
+
+
+// Reads an .ms2 file: S lines start a spectrum, Z lines give the MH+, and the
+// remaining numeric lines are "m/z intensity" peaks.
+static bool ReadMS2(const char *szFile,
+                    vector<BinnedSpectrum> &vSpectra)
+{
+   FILE *fp;
+   char szBuf[SIZE_BUF];
+   vector<pair<double,double> > vPeaks;
+   double dMH = 0.0;
+   double dMaxMZ = 0.0;
+   int iScan = 0;
+   int iNumRead = 0;
+
+   if ((fp=fopen(szFile, "r")) == NULL)
+      return false;
+
+   while (true)
+   {
+      bool bEOF = (fgets(szBuf, SIZE_BUF, fp) == NULL);
+
+      if ((bEOF || szBuf[0] == 'S') && !vPeaks.empty())
+      {
+         BinnedSpectrum spec;
+         char szName[SIZE_FILE + 32];
+
+         sprintf(szName, "%s scan %d", szFile, iScan);
+         spec.sName = szName;
+         BinSpectrum(vPeaks, (dMH > 0.0 ? dMH : dMaxMZ), spec);
+         vSpectra.push_back(spec);
+         vPeaks.clear();
+         iNumRead++;
+      }
+
+      if (bEOF)
+         break;
+
+      if (szBuf[0] == 'S')
+      {
+         sscanf(szBuf, "S %d", &iScan);
+         dMH = 0.0;
+         dMaxMZ = 0.0;
+      }
+      else if (szBuf[0] == 'Z')
+      {
+         int iCharge;
+         double dTmp;
+
+         if (sscanf(szBuf, "Z %d %lf", &iCharge, &dTmp) == 2 && dTmp > dMH)
+            dMH = dTmp;
+      }
+      else if (isdigit(szBuf[0]))
+      {
+         double dMZ;
+         double dInten;
+
+         if (sscanf(szBuf, "%lf %lf", &dMZ, &dInten) == 2)
+         {
+            vPeaks.push_back(make_pair(dMZ, dInten));
+            if (dMZ > dMaxMZ)
+               dMaxMZ = dMZ;
+         }
+      }
+   }
+
+   fclose(fp);
+   printf(" %s: %d spectra\n", szFile, iNumRead);
+   return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Checks
+///////////////////////////////////////////////////////////////////////////////
+
+static void Fail(const char *szWhat,
+                 const string &sName,
+                 int iArraySize,
+                 int iOffset,
+                 int iBin,
+                 double dGot,
+                 double dExpected)
+{
+   if (iNumFailures++ < 20)
+   {
+      printf(" FAIL %s: %s, size %d, offset %d, bin %d: %0.17g vs %0.17g\n",
+            szWhat, sName.c_str(), iArraySize, iOffset, iBin, dGot, dExpected);
+   }
+}
+
+// Runs every kernel on one array and compares against the original loops:
+//  - all kernels give bit identical windowed means and fast xcorr data;
+//  - the first segment of the windowed mean, and the whole mean when the array is
+//    too short to split, is bit identical to the original running sum;
+//  - the remaining bins agree with it to within rounding;
+//  - given the same windowed mean, the flanking pass is bit identical.
+template <typename T>
+static void CheckArray(const vector<double> &vdCorr,
+                       int iOffset,
+                       const string &sName,
+                       double dTol)
+{
+   int iArraySize = (int)vdCorr.size();
+   int iPadded = iArraySize + iOffset + 1;
+   vector<T> vCorr(iPadded, (T)0);
+   vector<T> vOldMean(iPadded, (T)0);
+   vector<float> vfOld(iPadded, 0.0f);
+   vector<T> vScalarMean;
+   vector<float> vfScalar;
+   int iSegmentSize = iArraySize / FASTXCORR_WINDOW_LANES;
+   int iExact = (iSegmentSize < 2 ? iArraySize : iSegmentSize);
+   int iKernel;
+   int i;
+   int iFlank;
+
+   for (i=0; i<iArraySize; i++)
+      vCorr[i] = (T)vdCorr[i];
+
+   OldWindowedMean(&vCorr[0], &vOldMean[0], iArraySize, iOffset);
+
+   for (iKernel=FASTXCORR_KERNEL_SCALAR; iKernel<=FASTXCORR_KERNEL_AVX; iKernel++)
+   {
+      if (!mango_FastXcorr::IsKernelSupported(iKernel))
+         continue;
+
+      // guard bins past the end must not be written
+      vector<T> vMean(iPadded, (T)-1);
+
+      mango_FastXcorr::MakeWindowedMean(&vCorr[0], &vMean[0], iArraySize, iOffset, iKernel);
+
+      if (vMean[iArraySize] != (T)-1)
+         Fail("windowed mean wrote past the array", sName, iArraySize, iOffset, iArraySize, vMean[iArraySize], -1);
+
+      for (i=0; i<iArraySize; i++)
+      {
+         if (i < iExact && memcmp(&vMean[i], &vOldMean[i], sizeof(T)))
+            Fail("windowed mean first segment not bit identical to original", sName, iArraySize, iOffset, i, vMean[i], vOldMean[i]);
+         else if (fabs((double)vMean[i] - (double)vOldMean[i]) > dTol)
+            Fail("windowed mean differs from original", sName, iArraySize, iOffset, i, vMean[i], vOldMean[i]);
+      }
+
+      if (iKernel == FASTXCORR_KERNEL_SCALAR)
+         vScalarMean = vMean;
+      else if (memcmp(&vMean[0], &vScalarMean[0], iArraySize*sizeof(T)))
+         Fail("windowed mean differs between kernels", sName, iArraySize, iOffset, -1, iKernel, 0);
+
+      for (iFlank=0; iFlank<2; iFlank++)
+      {
+         vector<float> vfNew(iPadded, -1.0f);
+         vector<float> vfEnd(iPadded, -1.0f);
+
+         OldFastXcorrData(&vCorr[0], &vOldMean[0], &vfOld[0], iArraySize, iFlank == 1);
+         mango_FastXcorr::MakeFastXcorrData(&vCorr[0], &vOldMean[0], &vfNew[0], iArraySize, iFlank == 1, iKernel);
+         mango_FastXcorr::MakeFastXcorrData(&vCorr[0], &vMean[0], &vfEnd[0], iArraySize, iFlank == 1, iKernel);
+
+         if (vfNew[iArraySize] != -1.0f)
+            Fail("fast xcorr data wrote past the array", sName, iArraySize, iOffset, iArraySize, vfNew[iArraySize], -1);
+
+         for (i=0; i<iArraySize; i++)
+         {
+            if (memcmp(&vfNew[i], &vfOld[i], sizeof(float)))
+               Fail(iFlank ? "flanking peaks not bit identical" : "fast xcorr not bit identical",
+                     sName, iArraySize, iOffset, i, vfNew[i], vfOld[i]);
+
+            // end to end, fast xcorr from the kernel's own windowed mean
+            if (fabs((double)vfEnd[i] - (double)vfOld[i]) > TEST_TOL_FLOAT)
+               Fail("fast xcorr differs from original", sName, iArraySize, iOffset, i, vfEnd[i], vfOld[i]);
+         }
+
+         if (iKernel == FASTXCORR_KERNEL_SCALAR)
+         {
+            if (iFlank == 1)
+               vfScalar = vfEnd;
+         }
+         else if (iFlank == 1 && memcmp(&vfEnd[0], &vfScalar[0], iArraySize*sizeof(float)))
+            Fail("fast xcorr differs between kernels", sName, iArraySize, iOffset, -1, iKernel, 0);
+      }
+   }
+}
+
+
+static void CheckEdgeCases()
+{
+   static const int piSize[] = { 1, 2, 3, 4, 5, 7, 8, 9, 11, 16, 17, 100, 150, 151, 152, 153, 301,
+      302, 303, 304, 305, 600, 603, 604, 605, 1000, 4099 };
+   static const int piOffset[] = { 1, 2, 3, 75, 200 };
+   size_t i;
+   size_t ii;
+   int j;
+   int iNumCases = 0;
+
+   for (i=0; i<sizeof(piSize)/sizeof(int); i++)
+   {
+      for (ii=0; ii<sizeof(piOffset)/sizeof(int); ii++)
+      {
+         int iSize = piSize[i];
+         int iOffset = piOffset[ii];
+         vector<double> vdZero(iSize, 0.0);
+         vector<double> vdDense(iSize);
+         vector<double> vdSparse(iSize, 0.0);
+         char szName[64];
+
+         for (j=0; j<iSize; j++)
+         {
+            vdDense[j] = 50.0*RandomUnit();
+            if (NextRandom() % 20 == 0)
+               vdSparse[j] = 50.0*RandomUnit();
+         }
+         // peaks on the first and last bins exercise the window edges
+         vdSparse[0] = 50.0;
+         vdSparse[iSize-1] = 25.0;
+
+         sprintf(szName, "zero");
+         CheckArray<double>(vdZero, iOffset, szName, TEST_TOL_DOUBLE);
+         CheckArray<float>(vdZero, iOffset, szName, TEST_TOL_FLOAT);
+         sprintf(szName, "dense");
+         CheckArray<double>(vdDense, iOffset, szName, TEST_TOL_DOUBLE);
+         CheckArray<float>(vdDense, iOffset, szName, TEST_TOL_FLOAT);
+         sprintf(szName, "sparse");
+         CheckArray<double>(vdSparse, iOffset, szName, TEST_TOL_DOUBLE);
+         CheckArray<float>(vdSparse, iOffset, szName, TEST_TOL_FLOAT);
+         iNumCases += 6;
+      }
+   }
+
+   printf(" edge cases: %d arrays (sizes 1 to %d, offsets 1 to %d)\n", iNumCases,
+         piSize[sizeof(piSize)/sizeof(int)-1], piOffset[sizeof(piOffset)/sizeof(int)-1]);
+}
+
+
+static double Seconds(std::chrono::steady_clock::time_point tStart)
+{
+   return std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+}
+
+// Time per spectrum of the original loops and of each kernel, windowed mean
+// plus flanking peaks.
+static void Benchmark(const vector<BinnedSpectrum> &vSpectra)
+{
+   size_t iMaxSize = 0;
+   size_t i;
+   int iKernel;
+   int iRep;
+   int iNumRep = 20;
+   double dOld = 0.0;
+
+   for (i=0; i<vSpectra.size(); i++)
+   {
+      if (vSpectra[i].vdCorr.size() > iMaxSize)
+         iMaxSize = vSpectra[i].vdCorr.size();
+   }
+
+   vector<double> vdMean(iMaxSize + TEST_XCORR_OFFSET + 1, 0.0);
+   vector<float> vfFast(iMaxSize + 1, 0.0f);
+   vector<vector<double> > vvdPadded(vSpectra.size());
+
+   for (i=0; i<vSpectra.size(); i++)
+   {
+      vvdPadded[i] = vSpectra[i].vdCorr;
+      vvdPadded[i].resize(vSpectra[i].vdCorr.size() + TEST_XCORR_OFFSET + 1, 0.0);
+   }
+
+   for (iKernel=-1; iKernel<=FASTXCORR_KERNEL_AVX; iKernel++)
+   {
+      if (iKernel >= 0 && !mango_FastXcorr::IsKernelSupported(iKernel))
+         continue;
+
+      std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+
+      for (iRep=0; iRep<iNumRep; iRep++)
+      {
+         for (i=0; i<vSpectra.size(); i++)
+         {
+            int iArraySize = (int)vSpectra[i].vdCorr.size();
+
+            if (iKernel < 0)
+            {
+               OldWindowedMean(&vvdPadded[i][0], &vdMean[0], iArraySize, TEST_XCORR_OFFSET);
+               OldFastXcorrData(&vvdPadded[i][0], &vdMean[0], &vfFast[0], iArraySize, true);
+            }
+            else
+            {
+               mango_FastXcorr::MakeWindowedMean(&vvdPadded[i][0], &vdMean[0], iArraySize, TEST_XCORR_OFFSET, iKernel);
+               mango_FastXcorr::MakeFastXcorrData(&vvdPadded[i][0], &vdMean[0], &vfFast[0], iArraySize, true, iKernel);
+            }
+         }
+      }
+
+      double dTime = Seconds(tStart) * 1.0E6 / (double)(iNumRep * vSpectra.size());
+
+      if (iKernel < 0)
+      {
+         dOld = dTime;
+         printf(" original loops:  %0.1f us/spectrum\n", dTime);
+      }
+      else
+      {
+         printf(" %-6s kernel:   %0.1f us/spectrum  (%0.1fx)\n", szKernelName[iKernel], dTime, dOld/dTime);
+      }
+   }
+}
+
+
+int main(int argc, char *argv[])
+{
+   vector<BinnedSpectrum> vSpectra;
+   size_t i;
+   int j;
+
+   printf(" kernels:");
+   for (j=FASTXCORR_KERNEL_SCALAR; j<=FASTXCORR_KERNEL_AVX; j++)
+   {
+      if (mango_FastXcorr::IsKernelSupported(j))
+         printf(" %s", szKernelName[j]);
+   }
+   printf("; default %s\n", szKernelName[mango_FastXcorr::GetKernel()]);
+
+   CheckEdgeCases();
+
+   for (j=1; j<argc; j++)
+   {
+      if (!ReadMS2(argv[j], vSpectra))
+      {
+         printf(" Error - cannot read %s\n", argv[j]);
+         return 1;
+      }
+   }
+
+   if (vSpectra.empty())
+      MakeSyntheticSpectra(TEST_NUM_SPECTRA, vSpectra);
+
+   for (i=0; i<vSpectra.size(); i++)
+   {
+      CheckArray<double>(vSpectra[i].vdCorr, TEST_XCORR_OFFSET, vSpectra[i].sName, TEST_TOL_DOUBLE);
+      CheckArray<float>(vSpectra[i].vdCorr, TEST_XCORR_OFFSET, vSpectra[i].sName, TEST_TOL_FLOAT);
+   }
+   printf(" spectra: %d\n", (int)vSpectra.size());
+
+   if (iNumFailures > 0)
+   {
+      printf(" %d failures\n", iNumFailures);
+      return 1;
+   }
+
+   Benchmark(vSpectra);
+   printf(" passed\n");
+
+   return 0;
+}
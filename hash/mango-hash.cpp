@@ -13,6 +13,14 @@
 */
 
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
 #include <iostream>
 #include <string>
 #include <cstdlib>
@@ -21,7 +29,12 @@
 #include <fstream>
 #include <set>
 #include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <cstddef>
 #include <algorithm>
+#include <thread>
+#include <unordered_map>
 
 #include "protein_pep_hash.pb.h"
 
@@ -35,7 +48,7 @@ using namespace std;
 
 #define MAX_EDGES 30
 
-float pp_amino_acid_mass[MAX_EDGES] = {  
+double pp_amino_acid_mass[MAX_EDGES] = {  
                71.037113805, //A 
                99999, //B not there
                160.03064805, //103.009184505 + 57.021464, //C
@@ -68,7 +81,16 @@ float protein_hash_db_::phd_calculate_mass_peptide(const string peptide)
 {
    float mass = 0;
    for (const char &c : peptide) {
-      mass += pp_amino_acid_mass[c - 'A'];
+      mass += (float)pp_amino_acid_mass[c - 'A'];
+   }
+   return mass;
+}
+
+float protein_hash_db_::phd_calculate_mass_peptide(const char *peptide, int length)
+{
+   float mass = 0;
+   for (int i = 0; i < length; i++) {
+      mass += (float)pp_amino_acid_mass[peptide[i] - 'A'];
    }
    return mass;
 }
@@ -77,55 +99,169 @@ float phd_calculate_mass_peptide(const string peptide)
 {
    float mass = 0;
    for (const char &c : peptide) {
-      mass += pp_amino_acid_mass[c - 'A'];
+      mass += (float)pp_amino_acid_mass[c - 'A'];
+   }
+   return mass;
+}
+
+static double phd_calculate_exact_mass(const char *peptide, int length)
+{
+   double mass = 0;
+   for (int i = 0; i < length; i++) {
+      mass += pp_amino_acid_mass[peptide[i] - 'A'];
    }
    return mass;
 }
 
+double protein_hash_db_::phd_calculate_exact_mass_peptide(const char *peptide, int length)
+{
+   return phd_calculate_exact_mass(peptide, length);
+}
+
+protein_hash_db_::protein_hash_db_()
+{
+   phd_map_base = NULL;
+   phd_map_size = 0;
+   phd_hdr = NULL;
+   phd_buckets = NULL;
+   phd_peptides = NULL;
+   phd_masses = NULL;
+   phd_protein_refs = NULL;
+   phd_proteins = NULL;
+   phd_strings = NULL;
+}
+
+protein_hash_db_::~protein_hash_db_()
+{
+   if (phd_map_base == NULL)
+      return;
+
+#ifdef _WIN32
+   delete [] phd_map_base;
+#else
+   munmap((void *)phd_map_base, phd_map_size);
+#endif
+   phd_map_base = NULL;
+}
+
+void protein_hash_db_::phd_get_peptide_view(uint64_t index, phd_peptide_view &view)
+{
+   const phd_flat_peptide &flat = phd_peptides[index];
+
+   view.phdpv_id = index;
+   view.phdpv_sequence = phd_strings + flat.phdfp_seq_offset;
+   view.phdpv_length = flat.phdfp_seq_length;
+   view.phdpv_protein_count = flat.phdfp_protein_count;
+   view.phdpv_protein_refs = phd_protein_refs + flat.phdfp_protein_ref;
+   view.phdpv_mass = phd_masses[index];
+}
+
+// Copy a peptide view into the protobuf message handed out by the copying lookup functions
+static void phd_copy_peptide_view(protein_hash_db_ *phdb, const phd_peptide_view &view,
+                                  peptide_hash_database::phd_peptide *peptide)
+{
+   peptide->set_phdpep_sequence(view.phdpv_sequence, view.phdpv_length);
+
+   for (uint32_t i = 0; i < view.phdpv_protein_count; i++) {
+      uint32_t length;
+      const char *name = phdb->phd_get_protein_name(view, i, &length);
+      peptide_hash_database::phd_protein *fp = peptide->add_phdpep_protein_list();
+      fp->set_phdpro_name(name, length);
+      fp->set_phdpro_id(phdb->phd_get_protein_id(view, i));
+   }
+}
+
+const char *protein_hash_db_::phd_get_protein_name(const phd_peptide_view &view, uint32_t which, uint32_t *length)
+{
+   const phd_flat_protein &pro = phd_proteins[view.phdpv_protein_refs[which]];
+
+   if (length != NULL)
+      *length = pro.phdfpro_name_length;
+   return phd_strings + pro.phdfpro_name_offset;
+}
+
+int protein_hash_db_::phd_get_protein_id(const phd_peptide_view &view, uint32_t which)
+{
+   return phd_proteins[view.phdpv_protein_refs[which]].phdfpro_id;
+}
+
+size_t protein_hash_db_::phd_get_peptide_views_ofmass(int mass, vector<phd_peptide_view> &views)
+{
+   views.clear();
+
+   if (phd_hdr == NULL || mass < 0 || mass >= (int)phd_hdr->phdf_max_mass)
+      return 0;
+
+   for (uint64_t i = phd_buckets[mass]; i < phd_buckets[mass + 1]; i++)
+   {
+      views.push_back(phd_peptide_view());
+      phd_get_peptide_view(i, views.back());
+   }
+   return views.size();
+}
+
+/*
+   The peptide table is sorted by exact mass, so all peptides within the
+   tolerance form one contiguous slice found with two binary searches.
+   Returns the number of peptides in the slice and its start in *first.
+*/
+uint64_t protein_hash_db_::phd_get_peptide_range_tolerance(double mass_given, double tolerance, uint64_t *first)
+{
+   *first = 0;
+
+   if (phd_hdr == NULL)
+      return 0;
+
+   const double *begin = phd_masses;
+   const double *end = phd_masses + phd_hdr->phdf_num_peptides;
+   const double *lo = std::lower_bound(begin, end, mass_given - tolerance);
+   const double *hi = std::upper_bound(lo, end, mass_given + tolerance);
+
+   *first = lo - begin;
+   return hi - lo;
+}
+
+size_t protein_hash_db_::phd_get_peptide_views_ofmass_tolerance(double mass_given, double tolerance,
+                                                                vector<phd_peptide_view> &views)
+{
+   uint64_t first;
+   uint64_t count = phd_get_peptide_range_tolerance(mass_given, tolerance, &first);
+
+   views.resize(count);
+   for (uint64_t i = 0; i < count; i++)
+      phd_get_peptide_view(first + i, views[i]);
+
+   return views.size();
+}
+
 vector<peptide_hash_database::phd_peptide>* protein_hash_db_::phd_get_peptides_ofmass(int mass)
 {
-   // another memory leak
+   // Caller owns the returned vector; prefer phd_get_peptide_views_ofmass
    vector<peptide_hash_database::phd_peptide> *ret = new vector<peptide_hash_database::phd_peptide>;
+   vector<phd_peptide_view> views;
 
-   peptide_hash_database::phd_peptide_mass pepm = phd_file_entry.phdpepm(mass);
-   if (pepm.phdpmass_mass() == mass)
-   {
-      for (int i = 0; i < pepm.phdpmass_peptide_list_size(); i++)
-      {
-         ret->push_back(pepm.phdpmass_peptide_list(i));
-      }
+   phd_get_peptide_views_ofmass(mass, views);
+   for (const phd_peptide_view &view : views) {
+      ret->push_back(peptide_hash_database::phd_peptide());
+      phd_copy_peptide_view(this, view, &ret->back());
    }
    return ret;
 }
 
-#define PEP_WITHIN_TOLERANCE(mass_given, tolerance, mass_computed) \
-  ((mass_computed <= (mass_given + tolerance)) && (mass_computed >= (mass_given - tolerance)))
-
 vector<peptide_hash_database::phd_peptide>* protein_hash_db_::phd_get_peptides_ofmass_tolerance(float mass_given, float tolerance)
 {
-   // another memory leak
+   // Caller owns the returned vector; prefer phd_get_peptide_views_ofmass_tolerance
    vector<peptide_hash_database::phd_peptide> *ret = new vector<peptide_hash_database::phd_peptide>;
+   vector<phd_peptide_view> views;
 
-   int mass_min = floor(mass_given - tolerance);
-   int mass_max = ceil(mass_given + tolerance);
-
-   for (int mass = mass_min; mass <= mass_max; mass++)
-   {
-      peptide_hash_database::phd_peptide_mass pepm = phd_file_entry.phdpepm(mass);
-      if (pepm.phdpmass_mass() == mass) {
-         for (int i = 0; i < pepm.phdpmass_peptide_list_size(); i++) {
-            float mass_computed = phd_calculate_mass_peptide(pepm.phdpmass_peptide_list(i).phdpep_sequence());
-            if (PEP_WITHIN_TOLERANCE(mass_given, tolerance, mass_computed)) {
-               ret->push_back(pepm.phdpmass_peptide_list(i));
-            }
-         }
-      }
+   phd_get_peptide_views_ofmass_tolerance(mass_given, tolerance, views);
+   for (const phd_peptide_view &view : views) {
+      ret->push_back(peptide_hash_database::phd_peptide());
+      phd_copy_peptide_view(this, view, &ret->back());
    }
    return ret;
 }
 
-// Define a free function in the library to free the memory
-
 void phd_split_string(std::string str, std::string splitBy, std::vector<std::string>& tokens)
 {
    /* Store the original string in the array, so we can loop the rest
@@ -422,31 +558,49 @@ void phd_handle_semi_tryptic(enzyme_cut_params params, vector<range *> &nocut_sp
 
 }
 
-void phd_add_peptide_into_hash (string peptide, 
-                                 const peptide_hash_database::phd_protein pro_seq,
-                                 peptide_hash_database::phd_peptide_mass *pfile_pepm)
+/*
+   Build-time lookup from peptide sequence to its position in a mass bucket,
+   so adding a peptide no longer scans every peptide already in the bucket.
+   There is one table per integer mass so the buckets can be filled and
+   merged independently by different threads.
+*/
+struct phd_hash_build_index {
+   vector<unordered_map<string, int> > phdbi_buckets;
+   uint64_t                            phdbi_occurrences;   // peptides produced by the digestion
+   uint64_t                            phdbi_dedup_hits;    // occurrences folded into an existing peptide
+
+   phd_hash_build_index() : phdbi_buckets(MAX_PEPTIDE_MASS), phdbi_occurrences(0), phdbi_dedup_hits(0) { }
+};
+
+static peptide_hash_database::phd_peptide *phd_find_peptide_in_hash(const string &peptide,
+                                                                     peptide_hash_database::phd_peptide_mass *pfile_pepm,
+                                                                     unordered_map<string, int> &bucket_index,
+                                                                     uint64_t &dedup_hits)
 {
-   int found = 0;
-   peptide_hash_database::phd_peptide *found_peptide;
-   // Loop over the list of peptides to find whether this peptide is always first
-   for (int i = 0; i < pfile_pepm->phdpmass_peptide_list_size(); i++)
-   {
-       if (!strcmp(pfile_pepm->phdpmass_peptide_list(i).phdpep_sequence().c_str(), 
-                    peptide.c_str())) {
-           if (found) {
-              cout << "A duplicate found when it is not supposed to be. So, panicking" << endl;
-              exit(1);
-           }
-           found = 1;
-           found_peptide = pfile_pepm->mutable_phdpmass_peptide_list(i);
-       }
-   }
+   unordered_map<string, int>::iterator it = bucket_index.find(peptide);
 
-   if (!found) {
-       found_peptide = pfile_pepm->add_phdpmass_peptide_list();
-       found_peptide->set_phdpep_sequence(peptide);
+   if (it != bucket_index.end()) {
+      dedup_hits++;
+      return pfile_pepm->mutable_phdpmass_peptide_list(it->second);
    }
 
+   bucket_index.insert(make_pair(peptide, pfile_pepm->phdpmass_peptide_list_size()));
+   peptide_hash_database::phd_peptide *found_peptide = pfile_pepm->add_phdpmass_peptide_list();
+   found_peptide->set_phdpep_sequence(peptide);
+
+   return found_peptide;
+}
+
+void phd_add_peptide_into_hash (const string &peptide, 
+                                 const peptide_hash_database::phd_protein &pro_seq,
+                                 int mass,
+                                 peptide_hash_database::phd_file &pfile,
+                                 phd_hash_build_index &index)
+{
+   index.phdbi_occurrences++;
+   peptide_hash_database::phd_peptide *found_peptide = phd_find_peptide_in_hash(peptide,
+         pfile.mutable_phdpepm(mass), index.phdbi_buckets[mass], index.phdbi_dedup_hits);
+
    // Add the protein to the found peptide list
    peptide_hash_database::phd_protein* fp = found_peptide->add_phdpep_protein_list();
    fp->set_phdpro_name(pro_seq.phdpro_name());
@@ -454,10 +608,10 @@ void phd_add_peptide_into_hash (string peptide,
 }
 
 void phd_split_protein_sequence_peptides(enzyme_cut_params params, 
-                                          const peptide_hash_database::phd_protein pro_seq,
-                                          peptide_hash_database::phd_file &pfile)
+                                          const peptide_hash_database::phd_protein &pro_seq,
+                                          peptide_hash_database::phd_file &pfile,
+                                          phd_hash_build_index &index)
 {
-   //FIXME: Clean up memory. There are memory leaks
    const string protein_seq = pro_seq.phdpro_pepseq();
    vector<range *> splits, nocut_splits, final_splits;
 
@@ -479,7 +633,7 @@ void phd_split_protein_sequence_peptides(enzyme_cut_params params,
                " and its mass is " << mass << endl;
       */
       if (MIN_PEPTIDE_MASS < mass && mass < MAX_PEPTIDE_MASS) {
-         phd_add_peptide_into_hash(peptide, pro_seq, pfile.mutable_phdpepm(mass));
+         phd_add_peptide_into_hash(peptide, pro_seq, mass, pfile, index);
       }
    }
 
@@ -493,76 +647,452 @@ void phd_split_protein_sequence_peptides(enzyme_cut_params params,
    for (range *r: final_splits) delete r;
 }
 
-void phd_add_peptide_hash_database (peptide_hash_database::phd_file &pfile, 
-                                    enzyme_cut_params cut_params)
+static void phd_add_mass_buckets(peptide_hash_database::phd_file &pfile)
 {
-   const peptide_hash_database::phd_header hdr = pfile.phdhdr();
-// char szTmp[24];
-
    for (int i = 0; i < MAX_PEPTIDE_MASS; i++) {
       peptide_hash_database::phd_peptide_mass *pepm = pfile.add_phdpepm();
       pepm->set_phdpmass_mass(i);
    }
+}
 
-// cout << "Splitting peptides for protein id: ";
-   for (int i = 0; i < pfile.phdpro_size(); i++) {
-//    sprintf(szTmp, "%d", i);
-//    cout << szTmp;
-//    cout.flush();
-//    for (int ii=0; ii<strlen(szTmp);ii++)
-//       cout << '\b';
-      phd_split_protein_sequence_peptides(cut_params, pfile.phdpro(i), pfile);
+/*
+   Worker for the parallel digestion: splits the proteins [first, last) into
+   the thread's own set of mass buckets so no locking is needed.
+*/
+static void phd_digest_protein_range(enzyme_cut_params cut_params,
+                                     const peptide_hash_database::phd_file *pfile,
+                                     int first,
+                                     int last,
+                                     peptide_hash_database::phd_file *local,
+                                     phd_hash_build_index *local_index)
+{
+   phd_add_mass_buckets(*local);
+
+   for (int i = first; i < last; i++)
+      phd_split_protein_sequence_peptides(cut_params, pfile->phdpro(i), *local, *local_index);
+}
+
+/*
+   Folds the per-thread buckets of every num_threads-th mass, starting at
+   first_mass, into pfile.  Threads are merged in protein order so the
+   peptide and protein lists come out exactly as a serial digestion would
+   produce them.
+*/
+static void phd_merge_mass_buckets(vector<peptide_hash_database::phd_file *> *locals,
+                                   vector<phd_hash_build_index *> *local_indexes,
+                                   int first_mass,
+                                   int num_threads,
+                                   peptide_hash_database::phd_file *pfile,
+                                   phd_hash_build_index *index,
+                                   uint64_t *dedup_hits)
+{
+   for (int mass = first_mass; mass < MAX_PEPTIDE_MASS; mass += num_threads) {
+      peptide_hash_database::phd_peptide_mass *pepm = pfile->mutable_phdpepm(mass);
+      unordered_map<string, int> &bucket_index = index->phdbi_buckets[mass];
+
+      for (size_t t = 0; t < locals->size(); t++) {
+         peptide_hash_database::phd_peptide_mass *local_pepm = (*locals)[t]->mutable_phdpepm(mass);
+
+         if (pepm->phdpmass_peptide_list_size() == 0) {
+            pepm->Swap(local_pepm);
+            bucket_index.swap((*local_indexes)[t]->phdbi_buckets[mass]);
+            continue;
+         }
+
+         for (int i = 0; i < local_pepm->phdpmass_peptide_list_size(); i++) {
+            const peptide_hash_database::phd_peptide &local_pep = local_pepm->phdpmass_peptide_list(i);
+            peptide_hash_database::phd_peptide *pep = phd_find_peptide_in_hash(local_pep.phdpep_sequence(),
+                  pepm, bucket_index, *dedup_hits);
+            pep->mutable_phdpep_protein_list()->MergeFrom(local_pep.phdpep_protein_list());
+         }
+      }
+   }
+}
+
+static void phd_print_hash_build_report(const peptide_hash_database::phd_file &pfile,
+                                        const phd_hash_build_index &index)
+{
+   uint64_t num_peptides = 0;
+   int num_buckets = 0;
+   int largest_bucket = 0;
+   int largest_mass = 0;
+
+   for (int i = 0; i < pfile.phdpepm_size(); i++) {
+      int size = pfile.phdpepm(i).phdpmass_peptide_list_size();
+
+      num_peptides += size;
+      if (size > 0)
+         num_buckets++;
+      if (size > largest_bucket) {
+         largest_bucket = size;
+         largest_mass = i;
+      }
    }
-// cout << endl;
 
-   // If the parameter is semi-tryptic, add all left and right semi-tryptic peptides
+   cout << "Peptide hash: " << index.phdbi_occurrences << " digested peptides, "
+        << num_peptides << " unique, " << index.phdbi_dedup_hits << " duplicates merged" << endl;
+   cout << "Peptide hash: " << num_buckets << " non-empty mass buckets, average "
+        << (num_buckets ? num_peptides / num_buckets : 0) << " peptides, largest "
+        << largest_bucket << " peptides at mass " << largest_mass << endl;
+
+   // Coarse bucket size profile in 500 Da ranges
+   for (int start = 0; start < pfile.phdpepm_size(); start += 500) {
+      uint64_t range_peptides = 0;
+      int range_largest = 0;
+
+      for (int i = start; i < start + 500 && i < pfile.phdpepm_size(); i++) {
+         int size = pfile.phdpepm(i).phdpmass_peptide_list_size();
+         range_peptides += size;
+         if (size > range_largest)
+            range_largest = size;
+      }
+
+      if (range_peptides > 0)
+         cout << "   mass " << start << "-" << start + 499 << ": " << range_peptides
+              << " peptides, largest bucket " << range_largest << endl;
+   }
 }
 
-void phd_save_hash_db(peptide_hash_database::phd_file &pfile, const char *hash_file)
+void phd_add_peptide_hash_database (peptide_hash_database::phd_file &pfile, 
+                                    enzyme_cut_params cut_params)
+{
+   phd_hash_build_index index;
+   int num_threads = cut_params.num_threads;
+
+   if (num_threads <= 0)
+      num_threads = std::thread::hardware_concurrency();
+   if (num_threads > pfile.phdpro_size())
+      num_threads = pfile.phdpro_size();
+   if (num_threads < 1)
+      num_threads = 1;
+
+   phd_add_mass_buckets(pfile);
+
+   if (num_threads == 1) {
+      for (int i = 0; i < pfile.phdpro_size(); i++)
+         phd_split_protein_sequence_peptides(cut_params, pfile.phdpro(i), pfile, index);
+      phd_print_hash_build_report(pfile, index);
+      return;
+   }
+
+   cout << "Digesting " << pfile.phdpro_size() << " proteins using " << num_threads << " threads" << endl;
+
+   // Each thread digests a contiguous block of proteins into its own buckets
+   vector<peptide_hash_database::phd_file *> locals;
+   vector<phd_hash_build_index *> local_indexes;
+   vector<uint64_t> merge_dedup_hits(num_threads, 0);
+   vector<std::thread> workers;
+   int num_proteins = pfile.phdpro_size();
+
+   for (int t = 0; t < num_threads; t++) {
+      locals.push_back(new peptide_hash_database::phd_file());
+      local_indexes.push_back(new phd_hash_build_index());
+   }
+
+   for (int t = 0; t < num_threads; t++) {
+      int first = (int)((long long)num_proteins * t / num_threads);
+      int last = (int)((long long)num_proteins * (t + 1) / num_threads);
+      workers.push_back(std::thread(phd_digest_protein_range, cut_params, &pfile, first, last,
+                                    locals[t], local_indexes[t]));
+   }
+   for (std::thread &w : workers) w.join();
+   workers.clear();
+
+   // The mass buckets are independent, so the merge is spread over the threads as well
+   for (int t = 0; t < num_threads; t++)
+      workers.push_back(std::thread(phd_merge_mass_buckets, &locals, &local_indexes, t, num_threads,
+                                    &pfile, &index, &merge_dedup_hits[t]));
+   for (std::thread &w : workers) w.join();
+
+   for (int t = 0; t < num_threads; t++) {
+      index.phdbi_occurrences += local_indexes[t]->phdbi_occurrences;
+      index.phdbi_dedup_hits += local_indexes[t]->phdbi_dedup_hits + merge_dedup_hits[t];
+      delete locals[t];
+      delete local_indexes[t];
+   }
+
+   phd_print_hash_build_report(pfile, index);
+}
+
+static inline uint64_t phd_flat_align(uint64_t offset)
 {
-   /*
-   peptide_hash_database::phd_header hdr;
+   return (offset + 7) & ~(uint64_t)7;
+}
+
+static void phd_flat_copy_amino(char *dest, const string &amino)
+{
+   if (amino.length() >= PHD_FLAT_AMINO_LEN) {
+      cout << "Enzyme amino acid list " << amino << " is too long for the hash file" << endl;
+      exit(1);
+   }
+   memset(dest, 0, PHD_FLAT_AMINO_LEN);
+   strcpy(dest, amino.c_str());
+}
 
-   // Create header which is mandatory
-   hdr = pfile.phdhdr();
-   */
-// cout << "Creating file" << endl;
+static void phd_flat_write(std::ofstream &ofs, const void *data, uint64_t size, uint64_t &written)
+{
+   ofs.write((const char *)data, size);
+   written += size;
+}
 
+static void phd_flat_pad(std::ofstream &ofs, uint64_t offset, uint64_t &written)
+{
+   static const char zeros[8] = { 0 };
+   phd_flat_write(ofs, zeros, offset - written, written);
+}
+
+struct phd_save_peptide {
+   const peptide_hash_database::phd_peptide *phdsp_peptide;
+   double                                    phdsp_mass;
+};
+
+static bool phd_save_peptide_lessthan(const phd_save_peptide &a, const phd_save_peptide &b)
+{
+   return a.phdsp_mass < b.phdsp_mass;
+}
+
+void phd_save_hash_db(peptide_hash_database::phd_file &pfile, const char *hash_file)
+{
+   const peptide_hash_database::phd_header &hdr = pfile.phdhdr();
+   phd_flat_header fhdr;
+   uint64_t string_size = 0, num_peptides = 0, num_protein_refs = 0;
+   vector<phd_save_peptide> peptides;
+
+   // First pass sizes every section so the offsets can go in the header
+   for (int i = 0; i < pfile.phdpro_size(); i++)
+      string_size += pfile.phdpro(i).phdpro_name().length() + 1;
+
+   for (int mass = 0; mass < pfile.phdpepm_size(); mass++) {
+      const peptide_hash_database::phd_peptide_mass &pepm = pfile.phdpepm(mass);
+      for (int i = 0; i < pepm.phdpmass_peptide_list_size(); i++) {
+         const peptide_hash_database::phd_peptide &peptide = pepm.phdpmass_peptide_list(i);
+         phd_save_peptide sp;
+
+         sp.phdsp_peptide = &peptide;
+         sp.phdsp_mass = phd_calculate_exact_mass(peptide.phdpep_sequence().c_str(), peptide.phdpep_sequence().length());
+         peptides.push_back(sp);
+
+         string_size += peptide.phdpep_sequence().length() + 1;
+         num_protein_refs += peptide.phdpep_protein_list_size();
+         num_peptides++;
+      }
+   }
+
+   // Order by exact mass; stable so equal masses keep their digestion order
+   std::stable_sort(peptides.begin(), peptides.end(), phd_save_peptide_lessthan);
+
+   memset(&fhdr, 0, sizeof(fhdr));
+   memcpy(fhdr.phdf_magic, PHD_FLAT_MAGIC, sizeof(fhdr.phdf_magic));
+   fhdr.phdf_version = PHD_FLAT_VERSION;
+   fhdr.phdf_header_size = sizeof(fhdr);
+   fhdr.phdf_missed_cleavage = hdr.phdhdr_missed_cleavage();
+   fhdr.phdf_semi_tryptic = hdr.phdhdr_semi_tryptic();
+   phd_flat_copy_amino(fhdr.phdf_precut_amino, hdr.phdhdr_precut_amino());
+   phd_flat_copy_amino(fhdr.phdf_postcut_amino, hdr.phdhdr_postcut_amino());
+   phd_flat_copy_amino(fhdr.phdf_prenocut_amino, hdr.phdhdr_prenocut_amino());
+   phd_flat_copy_amino(fhdr.phdf_postnocut_amino, hdr.phdhdr_postnocut_amino());
+
+   fhdr.phdf_max_mass = pfile.phdpepm_size();
+   fhdr.phdf_num_proteins = pfile.phdpro_size();
+   fhdr.phdf_num_peptides = num_peptides;
+   fhdr.phdf_num_protein_refs = num_protein_refs;
+   fhdr.phdf_fasta_size = hdr.phdhdr_protein_source_file_size();
+   fhdr.phdf_fasta_mtime = hdr.phdhdr_protein_source_file_mtime();
+   fhdr.phdf_fasta_digest = strtoull(hdr.phdhdr_protein_source_file_digest().c_str(), NULL, 16);
+
+   fhdr.phdf_bucket_offset = phd_flat_align(sizeof(fhdr));
+   fhdr.phdf_peptide_offset = phd_flat_align(fhdr.phdf_bucket_offset + (fhdr.phdf_max_mass + 1) * sizeof(uint64_t));
+   fhdr.phdf_mass_offset = phd_flat_align(fhdr.phdf_peptide_offset + num_peptides * sizeof(phd_flat_peptide));
+   fhdr.phdf_protein_ref_offset = phd_flat_align(fhdr.phdf_mass_offset + num_peptides * sizeof(double));
+   fhdr.phdf_protein_offset = phd_flat_align(fhdr.phdf_protein_ref_offset + num_protein_refs * sizeof(uint32_t));
+   fhdr.phdf_string_offset = phd_flat_align(fhdr.phdf_protein_offset + fhdr.phdf_num_proteins * sizeof(phd_flat_protein));
+   fhdr.phdf_string_size = string_size;
+   fhdr.phdf_file_size = fhdr.phdf_string_offset + string_size;
+
+   // Write to a temporary file and rename it into place: other processes may have the
+   // old file mapped, and one starting now must never map a partly written file
+   string tmp_file = string(hash_file) + "." + std::to_string((long long)getpid());
    std::ofstream ofs;
-   ofs.open (hash_file, ios::out | ios::trunc | ios::binary);
-   if (!pfile.SerializeToOstream(&ofs)) {
+   ofs.open (tmp_file.c_str(), ios::out | ios::trunc | ios::binary);
+   if (!ofs) {
       cout << "Cannot write to hash file" << endl;
       exit(1);
    }
 
-// cout << "Wrote file" << endl;
+   uint64_t written = 0;
+   phd_flat_write(ofs, &fhdr, sizeof(fhdr), written);
+
+   // Bucket index: peptides of integer mass m are [bucket[m], bucket[m+1]).  The
+   // buckets follow the exact mass so they stay consistent with the sort order.
+   phd_flat_pad(ofs, fhdr.phdf_bucket_offset, written);
+   uint64_t bucket = 0;
+   for (uint32_t mass = 0; mass <= fhdr.phdf_max_mass; mass++) {
+      while (bucket < num_peptides
+            && (mass == fhdr.phdf_max_mass || peptides[bucket].phdsp_mass < mass))
+         bucket++;
+      phd_flat_write(ofs, &bucket, sizeof(bucket), written);
+   }
+
+   // Peptide table; sequences are laid out in the string pool after the protein names
+   phd_flat_pad(ofs, fhdr.phdf_peptide_offset, written);
+   uint64_t string_offset = 0, protein_ref = 0;
+   for (int i = 0; i < pfile.phdpro_size(); i++)
+      string_offset += pfile.phdpro(i).phdpro_name().length() + 1;
+
+   for (const phd_save_peptide &sp : peptides) {
+      const peptide_hash_database::phd_peptide &peptide = *sp.phdsp_peptide;
+      phd_flat_peptide fpep;
+
+      memset(&fpep, 0, sizeof(fpep));
+      fpep.phdfp_seq_offset = string_offset;
+      fpep.phdfp_seq_length = peptide.phdpep_sequence().length();
+      fpep.phdfp_protein_ref = protein_ref;
+      fpep.phdfp_protein_count = peptide.phdpep_protein_list_size();
+      phd_flat_write(ofs, &fpep, sizeof(fpep), written);
+
+      string_offset += fpep.phdfp_seq_length + 1;
+      protein_ref += fpep.phdfp_protein_count;
+   }
+
+   // Exact masses, parallel to the peptide table
+   phd_flat_pad(ofs, fhdr.phdf_mass_offset, written);
+   for (const phd_save_peptide &sp : peptides)
+      phd_flat_write(ofs, &sp.phdsp_mass, sizeof(sp.phdsp_mass), written);
+
+   // Protein references; protein ids are assigned 1..n in the order the proteins were read
+   phd_flat_pad(ofs, fhdr.phdf_protein_ref_offset, written);
+   for (const phd_save_peptide &sp : peptides) {
+      const peptide_hash_database::phd_peptide &peptide = *sp.phdsp_peptide;
+      for (int j = 0; j < peptide.phdpep_protein_list_size(); j++) {
+         uint32_t index = peptide.phdpep_protein_list(j).phdpro_id() - 1;
+         phd_flat_write(ofs, &index, sizeof(index), written);
+      }
+   }
+
+   // Protein table
+   phd_flat_pad(ofs, fhdr.phdf_protein_offset, written);
+   string_offset = 0;
+   for (int i = 0; i < pfile.phdpro_size(); i++) {
+      phd_flat_protein fpro;
+
+      memset(&fpro, 0, sizeof(fpro));
+      fpro.phdfpro_name_offset = string_offset;
+      fpro.phdfpro_name_length = pfile.phdpro(i).phdpro_name().length();
+      fpro.phdfpro_id = pfile.phdpro(i).phdpro_id();
+      phd_flat_write(ofs, &fpro, sizeof(fpro), written);
+
+      string_offset += fpro.phdfpro_name_length + 1;
+   }
+
+   // String pool
+   phd_flat_pad(ofs, fhdr.phdf_string_offset, written);
+   for (int i = 0; i < pfile.phdpro_size(); i++) {
+      const string &name = pfile.phdpro(i).phdpro_name();
+      phd_flat_write(ofs, name.c_str(), name.length() + 1, written);
+   }
+   for (const phd_save_peptide &sp : peptides) {
+      const string &seq = sp.phdsp_peptide->phdpep_sequence();
+      phd_flat_write(ofs, seq.c_str(), seq.length() + 1, written);
+   }
+
    ofs.close();
+   if (!ofs || written != fhdr.phdf_file_size) {
+      cout << "Cannot write to hash file" << endl;
+      remove(tmp_file.c_str());
+      exit(1);
+   }
+
+#ifdef _WIN32
+   // rename does not replace an existing file here; nothing maps it on Windows
+   remove(hash_file);
+#endif
+   if (rename(tmp_file.c_str(), hash_file) != 0) {
+      cout << "Cannot write to hash file" << endl;
+      remove(tmp_file.c_str());
+      exit(1);
+   }
 }
 
-void phd_print_hash_file_params(peptide_hash_database::phd_header hdr)
+void phd_print_hash_file_params(const phd_flat_header &hdr)
 {
    cout << endl 
          << "Parameters of the file: " << endl
-         << "Protein database file name is: " << hdr.phdhdr_precut_amino()<< endl
-         << "Tryptic/Semi-tryptic run: " << hdr.phdhdr_semi_tryptic() << endl
-         << "Pre break amino acids: " << hdr.phdhdr_precut_amino() << endl
-         << "Post break amino acids: " << hdr.phdhdr_postcut_amino() << endl
-         << "Pre no break amino acids: " << hdr.phdhdr_prenocut_amino() << endl
-         << "Post no break amino acids: " << hdr.phdhdr_postnocut_amino() << endl
-         << "Internal lysine (missed cleavage): " << hdr.phdhdr_missed_cleavage() << endl 
+         << "Tryptic/Semi-tryptic run: " << hdr.phdf_semi_tryptic << endl
+         << "Pre break amino acids: " << hdr.phdf_precut_amino << endl
+         << "Post break amino acids: " << hdr.phdf_postcut_amino << endl
+         << "Pre no break amino acids: " << hdr.phdf_prenocut_amino << endl
+         << "Post no break amino acids: " << hdr.phdf_postnocut_amino << endl
+         << "Internal lysine (missed cleavage): " << hdr.phdf_missed_cleavage << endl 
+         << "Number of proteins: " << hdr.phdf_num_proteins << endl
+         << "Number of peptides: " << hdr.phdf_num_peptides << endl
+         << "Protein database size: " << hdr.phdf_fasta_size << endl
+         << "Protein database digest: " << hex << hdr.phdf_fasta_digest << dec << endl
          <<endl;
 
 }
 
-void phd_populate_hdr_params(enzyme_cut_params params, 
+// Size and modification time of the FASTA file; returns 0 on success
+static int phd_stat_protein_file(const char *protein_file, uint64_t &size, int64_t &mtime)
+{
+   struct stat st;
+
+   if (stat(protein_file, &st) != 0)
+      return 1;
+
+   size = st.st_size;
+   mtime = st.st_mtime;
+   return 0;
+}
+
+// 64 bit FNV-1a digest of the FASTA file contents; returns 0 on success
+static int phd_digest_protein_file(const char *protein_file, uint64_t &digest)
+{
+   FILE *fp;
+   static const size_t buf_size = 1 << 20;
+   unsigned char *buf;
+   size_t len;
+
+   if ((fp = fopen(protein_file, "rb")) == NULL)
+      return 1;
+
+   buf = new unsigned char[buf_size];
+   digest = 14695981039346656037ULL;
+   while ((len = fread(buf, 1, buf_size, fp)) > 0) {
+      for (size_t i = 0; i < len; i++) {
+         digest ^= buf[i];
+         digest *= 1099511628211ULL;
+      }
+   }
+   delete [] buf;
+
+   int ret_value = ferror(fp) ? 1 : 0;
+   fclose(fp);
+   return ret_value;
+}
+
+void phd_populate_hdr_params(const char *protein_file,
+                              const char *phd_file,
+                              int num_proteins,
+                              enzyme_cut_params params, 
                               peptide_hash_database::phd_header *phdr)
 {
+   uint64_t size = 0, digest = 0;
+   int64_t mtime = 0;
+   char digest_str[24];
+
+   if (phd_stat_protein_file(protein_file, size, mtime) || phd_digest_protein_file(protein_file, digest)) {
+      cout << "Cannot read protein database " << protein_file << endl;
+      exit(1);
+   }
+   sprintf(digest_str, "%016llx", (unsigned long long)digest);
+
    phdr->set_phdhdr_version(1);
-   phdr->set_phdhdr_protein_source_filename("DEADBEEF");
-   phdr->set_phdhdr_protein_source_file_digest("DEADBEEF");
-   phdr->set_phdhdr_num_proteins(10);
-   phdr->set_phdhdr_hash_file_name("DEADBEEF");
-   phdr->set_phdhdr_hash_file_digest("DEADBEEF");
+   phdr->set_phdhdr_protein_source_filename(protein_file);
+   phdr->set_phdhdr_protein_source_file_digest(digest_str);
+   phdr->set_phdhdr_protein_source_file_size(size);
+   phdr->set_phdhdr_protein_source_file_mtime(mtime);
+   phdr->set_phdhdr_num_proteins(num_proteins);
+   phdr->set_phdhdr_hash_file_name(phd_file);
 
    phdr->set_phdhdr_precut_amino(params.precut_amino);
    phdr->set_phdhdr_postcut_amino(params.postcut_amino);
@@ -584,80 +1114,231 @@ void phd_create_hash_file (const char *protein_file, enzyme_cut_params params,
    phd_add_peptide_hash_database(pfile, params);
 
 // cout << "Populating header parameters" << endl;
-   phd_populate_hdr_params(params, pfile.mutable_phdhdr());
+   phd_populate_hdr_params(protein_file, phd_file, pfile.phdpro_size(), params, pfile.mutable_phdhdr());
 
    phd_save_hash_db(pfile, phd_file);
 }
 
-int phd_load_hash_file (const char *hash_file, peptide_hash_database::phd_file &pfile)
+// Reads just the fixed header; returns 0 if the file is missing or not a flat hash file
+static int phd_read_hash_file_header (const char *hash_file, phd_flat_header &hdr)
 {
+   FILE *fp;
+   int ret_value = 0;
+
+   if ((fp = fopen(hash_file, "rb")) == NULL)
+      return 0;
+
+   if (fread(&hdr, sizeof(hdr), 1, fp) == 1
+         && !memcmp(hdr.phdf_magic, PHD_FLAT_MAGIC, sizeof(hdr.phdf_magic))
+         && hdr.phdf_version == PHD_FLAT_VERSION
+         && hdr.phdf_header_size == sizeof(hdr)) {
+      ret_value = 1;
+   }
+
+   fclose(fp);
+   return ret_value;
+}
+
+// Stores a new FASTA mtime in the header of an existing hash file; returns 1 on success
+static int phd_update_hash_file_mtime (const char *hash_file, int64_t mtime)
+{
+   FILE *fp;
+   int ret_value = 0;
+
+   if ((fp = fopen(hash_file, "r+b")) == NULL)
+      return 0;
+
+   if (!fseek(fp, offsetof(phd_flat_header, phdf_fasta_mtime), SEEK_SET)
+         && fwrite(&mtime, sizeof(mtime), 1, fp) == 1) {
+      ret_value = 1;
+   }
+
+   if (fclose(fp))
+      ret_value = 0;
+   return ret_value;
+}
+
+// A section of count elements must start at or after the end of the previous one, be
+// 8 byte aligned and fit in the file; end is advanced past it.  Returns 1 if it does.
+static int phd_check_hash_file_section (uint64_t offset, uint64_t count, uint64_t elem_size,
+                                        uint64_t file_size, uint64_t &end)
+{
+   if (offset < end || (offset & 7) || offset > file_size
+         || count > (file_size - offset) / elem_size)
+      return 0;
+
+   end = offset + count * elem_size;
+   return 1;
+}
+
+// Checks that every section lies inside the file, in order, and that the bucket
+// index only points into the peptide table.  Returns 1 if the layout is sound.
+static int phd_check_hash_file_layout (const char *base, uint64_t file_size)
+{
+   const phd_flat_header *hdr = (const phd_flat_header *)base;
+   uint64_t end = hdr->phdf_header_size;
+
+   if (hdr->phdf_header_size != sizeof(phd_flat_header)
+         || hdr->phdf_file_size != file_size
+         || !phd_check_hash_file_section(hdr->phdf_bucket_offset, (uint64_t)hdr->phdf_max_mass + 1,
+                                         sizeof(uint64_t), file_size, end)
+         || !phd_check_hash_file_section(hdr->phdf_peptide_offset, hdr->phdf_num_peptides,
+                                         sizeof(phd_flat_peptide), file_size, end)
+         || !phd_check_hash_file_section(hdr->phdf_mass_offset, hdr->phdf_num_peptides,
+                                         sizeof(double), file_size, end)
+         || !phd_check_hash_file_section(hdr->phdf_protein_ref_offset, hdr->phdf_num_protein_refs,
+                                         sizeof(uint32_t), file_size, end)
+         || !phd_check_hash_file_section(hdr->phdf_protein_offset, hdr->phdf_num_proteins,
+                                         sizeof(phd_flat_protein), file_size, end)
+         || !phd_check_hash_file_section(hdr->phdf_string_offset, hdr->phdf_string_size,
+                                         1, file_size, end))
+      return 0;
+
+   const uint64_t *buckets = (const uint64_t *)(base + hdr->phdf_bucket_offset);
+   for (uint32_t mass = 0; mass < hdr->phdf_max_mass; mass++) {
+      if (buckets[mass] > buckets[mass + 1])
+         return 0;
+   }
+   if (buckets[hdr->phdf_max_mass] > hdr->phdf_num_peptides)
+      return 0;
+
+   return 1;
+}
+
+int phd_load_hash_file (const char *hash_file, protein_hash_db_ &phdb)
+{
+   struct stat st;
+   int fd;
+
 // cout << "File name is " << hash_file << endl;
-   fstream input(hash_file, ios::in | ios::binary);
-   if (!input) {
-      cout << hash_file << ": File not found.  Creating a new file." << endl;
+   if ((fd = open(hash_file, O_RDONLY)) < 0) {
+      cout << hash_file << ": File not found." << endl;
       return 1;
    }
 
-   if (pfile.ParseFromIstream(&input)) {
-//    cout << "Read the hash file: " << hash_file << endl;
-      peptide_hash_database::phd_header phdr = pfile.phdhdr();
-//    phd_print_hash_file_params(phdr);
-      return 0;
-   } else {
+   if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(phd_flat_header)) {
       cout << "File read has problems" << endl;
+      close(fd);
+      return 1;
    }
 
-   return 1;
+   phdb.phd_map_size = st.st_size;
+#ifdef _WIN32
+   char *buf = new char[phdb.phd_map_size];
+   if (read(fd, buf, phdb.phd_map_size) != (int)phdb.phd_map_size) {
+      cout << "File read has problems" << endl;
+      delete [] buf;
+      close(fd);
+      return 1;
+   }
+   phdb.phd_map_base = buf;
+#else
+   // Map read-only and shared so concurrent mango processes share the page cache
+   void *map = mmap(NULL, phdb.phd_map_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED) {
+      cout << "File read has problems" << endl;
+      close(fd);
+      return 1;
+   }
+   phdb.phd_map_base = (const char *)map;
+#endif
+   close(fd);
+
+   phdb.phd_hdr = (const phd_flat_header *)phdb.phd_map_base;
+   if (memcmp(phdb.phd_hdr->phdf_magic, PHD_FLAT_MAGIC, sizeof(phdb.phd_hdr->phdf_magic))
+         || phdb.phd_hdr->phdf_version != PHD_FLAT_VERSION
+         || !phd_check_hash_file_layout(phdb.phd_map_base, phdb.phd_map_size)) {
+      cout << "File read has problems" << endl;
+      phdb.phd_hdr = NULL;
+      return 1;
+   }
+
+   phdb.phd_buckets = (const uint64_t *)(phdb.phd_map_base + phdb.phd_hdr->phdf_bucket_offset);
+   phdb.phd_peptides = (const phd_flat_peptide *)(phdb.phd_map_base + phdb.phd_hdr->phdf_peptide_offset);
+   phdb.phd_masses = (const double *)(phdb.phd_map_base + phdb.phd_hdr->phdf_mass_offset);
+   phdb.phd_protein_refs = (const uint32_t *)(phdb.phd_map_base + phdb.phd_hdr->phdf_protein_ref_offset);
+   phdb.phd_proteins = (const phd_flat_protein *)(phdb.phd_map_base + phdb.phd_hdr->phdf_protein_offset);
+   phdb.phd_strings = phdb.phd_map_base + phdb.phd_hdr->phdf_string_offset;
+
+// phd_print_hash_file_params(*phdb.phd_hdr);
+   return 0;
 }
 
 int phd_compare_enzyme_cut_params_hash_file (enzyme_cut_params params,
-                                    peptide_hash_database::phd_header phdr)
+                                    const phd_flat_header &phdr)
 {
    int ret_value = 1;
 
-// cout << "Precut amino acid: " << params.precut_amino << " file " << phdr.phdhdr_precut_amino() << endl;
-   if (params.precut_amino.compare(phdr.phdhdr_precut_amino())) ret_value = 0;
+// cout << "Precut amino acid: " << params.precut_amino << " file " << phdr.phdf_precut_amino << endl;
+   if (params.precut_amino.compare(phdr.phdf_precut_amino)) ret_value = 0;
 
-// cout << "Postcut amino acid: " << params.postcut_amino << " file " << phdr.phdhdr_postcut_amino() << endl;
-   if (params.postcut_amino.compare(phdr.phdhdr_postcut_amino())) ret_value = 0;
+// cout << "Postcut amino acid: " << params.postcut_amino << " file " << phdr.phdf_postcut_amino << endl;
+   if (params.postcut_amino.compare(phdr.phdf_postcut_amino)) ret_value = 0;
 
-// cout << "Pre nocut amino acid: " << params.prenocut_amino << " file " << phdr.phdhdr_prenocut_amino() << endl;
-   if (params.prenocut_amino.compare(phdr.phdhdr_prenocut_amino())) ret_value = 0;
+// cout << "Pre nocut amino acid: " << params.prenocut_amino << " file " << phdr.phdf_prenocut_amino << endl;
+   if (params.prenocut_amino.compare(phdr.phdf_prenocut_amino)) ret_value = 0;
 
-// cout << "Post nocut amino acid: " << params.postnocut_amino << " file " << phdr.phdhdr_postnocut_amino() << endl;
-   if (params.postnocut_amino.compare(phdr.phdhdr_postnocut_amino())) ret_value = 0;
+// cout << "Post nocut amino acid: " << params.postnocut_amino << " file " << phdr.phdf_postnocut_amino << endl;
+   if (params.postnocut_amino.compare(phdr.phdf_postnocut_amino)) ret_value = 0;
 
-// cout << "Missed cleavage: " << params.missed_cleavage << " file " << phdr.phdhdr_missed_cleavage() << endl;
-   if ((params.missed_cleavage != phdr.phdhdr_missed_cleavage())) ret_value = 0;
+// cout << "Missed cleavage: " << params.missed_cleavage << " file " << phdr.phdf_missed_cleavage << endl;
+   if ((params.missed_cleavage != phdr.phdf_missed_cleavage)) ret_value = 0;
 
-// cout << "Semi tryptic : " << params.semi_tryptic << " file " << phdr.phdhdr_semi_tryptic() << endl;
-   if ((params.semi_tryptic != phdr.phdhdr_semi_tryptic())) ret_value = 0;
+// cout << "Semi tryptic : " << params.semi_tryptic << " file " << phdr.phdf_semi_tryptic << endl;
+   if ((params.semi_tryptic != phdr.phdf_semi_tryptic)) ret_value = 0;
 
    return ret_value;
 }
 
-inline int phd_hash_file_match_criteria (enzyme_cut_params params, const char *phd_file)
+/*
+   Size and mtime identical means the FASTA file is the one the hash was built
+   from.  When only the mtime moved the contents digest decides, so touching or
+   copying the file does not force a rebuild.  On a digest match the new mtime
+   is written back to the header so the next run skips the digest.
+*/
+int phd_compare_protein_file_hash_file (const char *protein_file,
+                                        const char *phd_file,
+                                        const phd_flat_header &phdr)
 {
-   peptide_hash_database::phd_file pfile;
-   int ret_value = 0;
+   uint64_t size, digest;
+   int64_t mtime;
+
+   if (phd_stat_protein_file(protein_file, size, mtime)) {
+      cout << " Warning - cannot read " << protein_file << "; using existing " << phd_file << endl;
+      return 1;
+   }
+
+   if (size == phdr.phdf_fasta_size && mtime == phdr.phdf_fasta_mtime)
+      return 1;
+
+   if (size == phdr.phdf_fasta_size
+         && !phd_digest_protein_file(protein_file, digest)
+         && digest == phdr.phdf_fasta_digest) {
+      if (!phd_update_hash_file_mtime(phd_file, mtime))
+         cout << " Warning - cannot update " << phd_file << "; " << protein_file << " will be digested again next run" << endl;
+      return 1;
+   }
+
+   cout << " " << protein_file << " has changed since " << phd_file << " was built.  Creating a new file." << endl;
+   return 0;
+}
+
+inline int phd_hash_file_match_criteria (const char *protein_file, enzyme_cut_params params, const char *phd_file)
+{
+   phd_flat_header phdr;
 
 // cout << "File name is " << phd_file << endl;
-   fstream input(phd_file, ios::in | ios::binary);
-   if (!input) {
-      cout << " " << phd_file << ": File not found.  Creating a new file." << endl;
+   if (!phd_read_hash_file_header(phd_file, phdr)) {
+      cout << " " << phd_file << ": File not found or old format.  Creating a new file." << endl;
       return 0;
    }
 
-   if (pfile.ParseFromIstream(&input)) {
-//    cout << "Reading the hash file and comparing the header param: " << phd_file << endl;
-      peptide_hash_database::phd_header phdr = pfile.phdhdr();
-      ret_value = phd_compare_enzyme_cut_params_hash_file(params, phdr);
-//    if (ret_value)ucout << "Comparing returned equal parameters" << endl;
-//    else cout << "Comparing returned non-equal parameters" << endl;
+   if (!phd_compare_enzyme_cut_params_hash_file(params, phdr)) {
+      cout << " " << phd_file << ": digestion parameters changed.  Creating a new file." << endl;
+      return 0;
    }
 
-   input.close();
-   return ret_value;
+   return phd_compare_protein_file_hash_file(protein_file, phd_file, phdr);
 }
       
 protein_hash_db_t phd_retrieve_hash_db (const char *protein_file, 
@@ -667,7 +1348,7 @@ protein_hash_db_t phd_retrieve_hash_db (const char *protein_file,
 
 //   cout << "In phd_retrieve_hash_db" << endl;
 
-   if (!phd_hash_file_match_criteria(params, phd_file)) {
+   if (!phd_hash_file_match_criteria(protein_file, params, phd_file)) {
       // Check the existance of both files
       // Parse the file and compare with the enzyme cut params and the digests
       // If something doesnt match, create one and return entry
@@ -678,7 +1359,10 @@ protein_hash_db_t phd_retrieve_hash_db (const char *protein_file,
 
    protein_hash_db_t ret_entry = new protein_hash_db_;
 // cout << "Loading hash database" << endl;
-   phd_load_hash_file(phd_file, ret_entry->phd_file_entry);
+   if (phd_load_hash_file(phd_file, *ret_entry)) {
+      cout << "Cannot load hash file " << phd_file << endl;
+      exit(1);
+   }
 
    return ret_entry;
 }
@@ -13,6 +13,7 @@
 */
 
 #include <string>
+#include <stdint.h>
 
 #include "protein_pep_hash.pb.h"
 
@@ -23,13 +24,116 @@ struct enzyme_cut_params {
    string      prenocut_amino;
    string      postnocut_amino;
    int         semi_tryptic;
+   int         num_threads;      // threads used to digest the FASTA file; 0 = poll CPU
+};
+
+/*
+   On-disk layout of the peptide hash file.  The file is mapped read-only and
+   queried in place, so every section is 8 byte aligned and only holds fixed
+   size records or offsets into the string pool:
+
+      phd_flat_header
+      uint64_t            bucket index [phdf_max_mass + 1]; start of each integer mass
+      phd_flat_peptide    peptide table, sorted by exact peptide mass
+      double              exact monoisotopic mass of each peptide table entry
+      uint32_t            protein references; indices into the protein table
+      phd_flat_protein    protein table
+      char                string pool; NUL terminated sequences and names
+*/
+
+#define PHD_FLAT_MAGIC        "MANGOPHD"
+#define PHD_FLAT_VERSION      4
+#define PHD_FLAT_AMINO_LEN    32
+
+struct phd_flat_header {
+   char        phdf_magic[8];
+   uint32_t    phdf_version;
+   uint32_t    phdf_header_size;
+
+   // enzyme digestion parameters the file was built with
+   int32_t     phdf_missed_cleavage;
+   int32_t     phdf_semi_tryptic;
+   char        phdf_precut_amino[PHD_FLAT_AMINO_LEN];
+   char        phdf_postcut_amino[PHD_FLAT_AMINO_LEN];
+   char        phdf_prenocut_amino[PHD_FLAT_AMINO_LEN];
+   char        phdf_postnocut_amino[PHD_FLAT_AMINO_LEN];
+
+   uint32_t    phdf_max_mass;             // number of integer mass buckets
+   uint32_t    phdf_reserved;
+   uint64_t    phdf_num_proteins;
+   uint64_t    phdf_num_peptides;
+   uint64_t    phdf_num_protein_refs;
+
+   // FASTA file the hash was built from; used to detect a stale hash file
+   uint64_t    phdf_fasta_size;
+   int64_t     phdf_fasta_mtime;
+   uint64_t    phdf_fasta_digest;         // 64 bit FNV-1a of the file contents
+
+   uint64_t    phdf_bucket_offset;        // byte offsets of each section from start of file
+   uint64_t    phdf_peptide_offset;
+   uint64_t    phdf_mass_offset;
+   uint64_t    phdf_protein_ref_offset;
+   uint64_t    phdf_protein_offset;
+   uint64_t    phdf_string_offset;
+   uint64_t    phdf_string_size;
+   uint64_t    phdf_file_size;
+};
+
+struct phd_flat_peptide {
+   uint64_t    phdfp_seq_offset;          // offset into string pool
+   uint64_t    phdfp_protein_ref;         // first entry in protein reference table
+   uint32_t    phdfp_seq_length;
+   uint32_t    phdfp_protein_count;
+};
+
+struct phd_flat_protein {
+   uint64_t    phdfpro_name_offset;       // offset into string pool
+   uint32_t    phdfpro_name_length;
+   int32_t     phdfpro_id;
+};
+
+/*
+   Lightweight view of one peptide of the loaded hash file.  The pointers
+   refer to the mapping itself, so they stay valid as long as the
+   protein_hash_db_ they came from and no memory is allocated per lookup.
+*/
+struct phd_peptide_view {
+   uint64_t           phdpv_id;             // index in the peptide table, unique per peptide
+   const char        *phdpv_sequence;       // NUL terminated
+   uint32_t           phdpv_length;
+   uint32_t           phdpv_protein_count;
+   const uint32_t    *phdpv_protein_refs;   // indices into phd_proteins
+   double             phdpv_mass;           // exact monoisotopic residue mass
 };
 
 struct protein_hash_db_ {
-   peptide_hash_database::phd_file phd_file_entry;
+   const char                 *phd_map_base;
+   size_t                      phd_map_size;
+   const phd_flat_header      *phd_hdr;
+   const uint64_t             *phd_buckets;
+   const phd_flat_peptide     *phd_peptides;
+   const double               *phd_masses;
+   const uint32_t             *phd_protein_refs;
+   const phd_flat_protein     *phd_proteins;
+   const char                 *phd_strings;
+
+   protein_hash_db_();
+   ~protein_hash_db_();
+
    vector<peptide_hash_database::phd_peptide>* phd_get_peptides_ofmass(int mass);
    vector<peptide_hash_database::phd_peptide>* phd_get_peptides_ofmass_tolerance(float mass_given, float tolerance);
+
+   // Allocation free lookups; the caller's buffer is cleared and refilled, keeping its capacity
+   size_t phd_get_peptide_views_ofmass(int mass, vector<phd_peptide_view> &views);
+   size_t phd_get_peptide_views_ofmass_tolerance(double mass_given, double tolerance, vector<phd_peptide_view> &views);
+   uint64_t phd_get_peptide_range_tolerance(double mass_given, double tolerance, uint64_t *first);
+   void phd_get_peptide_view(uint64_t index, phd_peptide_view &view);
+   const char *phd_get_protein_name(const phd_peptide_view &view, uint32_t which, uint32_t *length = NULL);
+   int phd_get_protein_id(const phd_peptide_view &view, uint32_t which);
+
    float phd_calculate_mass_peptide(const string peptide);
+   float phd_calculate_mass_peptide(const char *peptide, int length);
+   double phd_calculate_exact_mass_peptide(const char *peptide, int length);
 };
 
 typedef protein_hash_db_* protein_hash_db_t;
@@ -37,4 +141,3 @@ typedef protein_hash_db_* protein_hash_db_t;
 protein_hash_db_t phd_retrieve_hash_db (const char *protein_file,
                                         enzyme_cut_params params,
                                         const char *phd_file);
-
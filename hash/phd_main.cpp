@@ -25,7 +25,7 @@ using namespace std;
 
 #include "mango-hash.h"
 
-int phd_read_cmdline_enzyme_cut_params(char *argv[], enzyme_cut_params &params)
+int phd_read_cmdline_enzyme_cut_params(int argc, char *argv[], enzyme_cut_params &params)
 {
    string prot_file(argv[1]);
    int semi_tryptic = atoi(argv[2]);
@@ -35,6 +35,7 @@ int phd_read_cmdline_enzyme_cut_params(char *argv[], enzyme_cut_params &params)
    string postnocut_amino(argv[6]);
    int internal_lysine = atoi(argv[7]);
    string hash_file(argv[8]);
+   int num_threads = (argc > 9) ? atoi(argv[9]) : 0;
 
    // Validate the parameters: no intersection of pre and post and break and no-break
 
@@ -48,6 +49,7 @@ int phd_read_cmdline_enzyme_cut_params(char *argv[], enzyme_cut_params &params)
          << "Post no break amino acids: " << postnocut_amino << endl
          << "Internal lysine (missed cleavage): " << internal_lysine << endl 
          << "Hash file given is: " << hash_file << endl 
+         << "Number of threads (0 = poll CPU): " << num_threads << endl 
          <<endl;
 
    params.precut_amino = precut_amino;
@@ -56,6 +58,7 @@ int phd_read_cmdline_enzyme_cut_params(char *argv[], enzyme_cut_params &params)
    params.postnocut_amino = postnocut_amino;
    params.missed_cleavage = internal_lysine;
    params.semi_tryptic = semi_tryptic;
+   params.num_threads = num_threads;
 
    return 0;
 }
@@ -66,33 +69,31 @@ int main(int argc, char *argv[])
     Usage: <protein_database> <missed_cleavage> <cut_aminoacid> <ignore_prolin> <peptide_hash_file>
    */
 
-   if (argc != 9) {
+   if (argc != 9 && argc != 10) {
       cout << "./a.out <protein_database> <semi/tryptic> <precut_aa> " 
-            << "<postcut_aa> <prenocut_aa> <postnocut_aa> <internal_lysine> <saved_hash_file>" << endl;
+            << "<postcut_aa> <prenocut_aa> <postnocut_aa> <internal_lysine> <saved_hash_file> [num_threads]" << endl;
       exit(1);
    }
 
    enzyme_cut_params enz_params;
    protein_hash_db_t phdp;
-   if (!phd_read_cmdline_enzyme_cut_params(argv, enz_params)) {
+   if (!phd_read_cmdline_enzyme_cut_params(argc, argv, enz_params)) {
       phdp = phd_retrieve_hash_db(argv[1], enz_params, argv[8]);   
    } else {
       cout << "Parameters are not proper" << endl;
       exit(1);
    }
    
-   //retrieving peptides of mass 256
-   int mass;
+   //retrieving peptides of every mass
+   vector<phd_peptide_view> peptides;
    for (int mass = 0; mass < 5000; mass++) {
 
-      vector<peptide_hash_database::phd_peptide> *peptides = phdp->phd_get_peptides_ofmass(mass);
+      if (phdp->phd_get_peptide_views_ofmass(mass, peptides) == 0) continue;
+      for (const phd_peptide_view &peptide : peptides) {
+         cout << "Peptide sequence of mass " << mass << ": " << peptide.phdpv_sequence << " is contained in proteins ";
 
-      if ((*peptides).size() <= 0) continue;
-      for (peptide_hash_database::phd_peptide peptide : *peptides) {
-         cout << "Peptide sequence of mass " << mass << ": " << peptide.phdpep_sequence() << " is contained in proteins ";
-
-         for (int i = 0; i < peptide.phdpep_protein_list_size(); i++) {
-             cout << " Name: " << peptide.phdpep_protein_list(i).phdpro_name() << " Id: " << peptide.phdpep_protein_list(i).phdpro_id();
+         for (uint32_t i = 0; i < peptide.phdpv_protein_count; i++) {
+             cout << " Name: " << phdp->phd_get_protein_name(peptide, i) << " Id: " << phdp->phd_get_protein_id(peptide, i);
          }
 
          cout << endl;
@@ -0,0 +1,304 @@
+/*
+   Copyright 2017 University of Washington                          3-clause BSD license
+
+   Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+   3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//  Benchmark of the Hardklor .hk readers on a synthetic .hk2 file.  Times the
+//  original fgets/ftell/sscanf reader against mango_HardklorFile's parser and
+//  checks that both produce bit identical scans and peaks.
+//
+//  make hk-bench
+//  ./hk-bench [number of lines] [synthetic file]
+///////////////////////////////////////////////////////////////////////////////
+
+#include "Common.h"
+#include "mango_DataInternal.h"
+#include "mango_Hardklor.h"
+
+#define HK_BENCH_LINES      10000000
+#define HK_BENCH_FILE       "hk_bench.hk2"
+#define HK_BENCH_PEAKS      40          // P lines per S line
+#define HK_BENCH_REPEAT     3           // best of this many runs is reported
+
+
+static uint64_t lSeed = 88172645463325252ULL;
+
+static uint64_t NextRandom()
+{
+   lSeed ^= lSeed << 13;
+   lSeed ^= lSeed >> 7;
+   lSeed ^= lSeed << 17;
+   return lSeed;
+}
+
+
+// Writes lNumLines lines laid out like Hardklor output.  Most masses have the
+// usual 4 decimals; some have up to 15 digits (fast path limit), more than 15
+// digits or an exponent (strtod fallback), a '+' sign or a CRLF line end.
+static bool WriteSyntheticFile(const char *szFile,
+                               long lNumLines,
+                               long *plNumFallback)
+{
+   FILE *fp;
+   long lLine;
+   int iScanNumber = 0;
+
+   if ((fp=fopen(szFile, "w")) == NULL)
+      return false;
+
+   *plNumFallback = 0;
+
+   for (lLine=0; lLine<lNumLines; lLine++)
+   {
+      if (lLine % (HK_BENCH_PEAKS+1) == 0)
+      {
+         iScanNumber += 1 + (int)(NextRandom() % 3);
+         fprintf(fp, "S\t%d\t%0.4f\tsynthetic.mzXML\t%0.4f\t%d\t%0.4f\n",
+               iScanNumber, iScanNumber*0.01, 400.0 + (NextRandom() % 1600000)/1000.0,
+               1 + (int)(NextRandom() % 6), 1000.0 + (NextRandom() % 5000000)/1000.0);
+         continue;
+      }
+
+      uint64_t lRandom = NextRandom();
+      double dMass = 500.0 + (lRandom % 600000000000ULL) / 1.0E8;
+      int iCharge = 1 + (int)((lRandom >> 40) % 8);
+      double dIntensity = (double)((lRandom >> 20) % 10000000) / 10.0;
+      const char *szEOL = "\n";
+      char szMass[64];
+
+      switch ((lRandom >> 52) % 16)
+      {
+         case 0:
+            sprintf(szMass, "%0.11f", dMass);    // 15 digits, still the fast path
+            break;
+         case 1:
+            sprintf(szMass, "%0.15f", dMass);    // 19 digits
+            (*plNumFallback)++;
+            break;
+         case 2:
+            sprintf(szMass, "%0.9e", dMass);
+            (*plNumFallback)++;
+            break;
+         case 3:
+            sprintf(szMass, "+%0.4f", dMass);
+            break;
+         case 4:
+            sprintf(szMass, "%0.4f", dMass);
+            szEOL = "\r\n";
+            break;
+         default:
+            sprintf(szMass, "%0.4f", dMass);
+            break;
+      }
+
+      fprintf(fp, "P\t%s\t%d\t%0.1f\t%0.4f\t%0.4f-%0.4f\t%0.4f\t_\t%0.4f%s",
+            szMass, iCharge, dIntensity, dMass/iCharge + 1.007276, dMass/iCharge - 1.0, dMass/iCharge + 4.0,
+            0.0, 0.9 + (lRandom % 1000)/10000.0, szEOL);
+   }
+
+   return (fclose(fp) == 0);
+}
+
+
+// The reader READ_HK1/READ_HK2 used before mango_HardklorFile: fgets each line,
+// ftell after every line and fseek back onto the next S line, sscanf the fields.
+// Every scan is read here as if each one had a matching MS/MS spectrum.
+static bool ReadOld(const char *szFile,
+                    vector<HardklorScan> &vScans,
+                    vector<HardklorPeak> &vPeaks)
+{
+   FILE *fp;
+   char szBuf[SIZE_BUF];
+   long lFP = 0;
+   long lEndFP;
+
+   if ((fp=fopen(szFile, "r")) == NULL)
+      return false;
+
+   fseek(fp, 0, SEEK_END);
+   lEndFP = ftell(fp);
+   rewind(fp);
+
+   vScans.clear();
+   vPeaks.clear();
+   vPeaks.reserve(lEndFP / 48);
+
+   while (fgets(szBuf, SIZE_BUF, fp))
+   {
+      if (szBuf[0]=='S')
+      {
+         HardklorScan scan;
+
+         scan.iScanNumber = 0;
+         sscanf(szBuf, "S\t%d\t", &scan.iScanNumber);
+         scan.iNumPeaks = 0;
+         scan.lFirstPeak = vPeaks.size();
+
+         lFP = ftell(fp);
+
+         while (fgets(szBuf, SIZE_BUF, fp))
+         {
+            if (szBuf[0] == 'S')
+            {
+               fseek(fp, lFP, SEEK_SET);
+               break;
+            }
+
+            lFP = ftell(fp);
+
+            if (szBuf[0] == 'P')
+            {
+               HardklorPeak peak;
+
+               peak.dNeutralMass = 0.0;
+               peak.iCharge = 0;
+               peak.iIntensity = 0;
+               sscanf(szBuf, "P\t%lf\t%d\t%d\t", &peak.dNeutralMass, &peak.iCharge, &peak.iIntensity);
+
+               vPeaks.push_back(peak);
+               scan.iNumPeaks++;
+            }
+         }
+
+         vScans.push_back(scan);
+      }
+   }
+
+   fclose(fp);
+   return true;
+}
+
+
+// Returns the number of scans and peaks that differ; the first few are printed.
+static long Compare(vector<HardklorScan> &vScans,
+                    vector<HardklorPeak> &vPeaks,
+                    mango_HardklorFile &hkFile)
+{
+   long lNumDiffs = 0;
+   int i;
+   int ii;
+
+   if ((int)vScans.size() != hkFile.GetNumScans())
+   {
+      printf(" scan count differs: %d vs %d\n", (int)vScans.size(), hkFile.GetNumScans());
+      return 1;
+   }
+
+   for (i=0; i<(int)vScans.size(); i++)
+   {
+      const HardklorScan &scan = hkFile.GetScan(i);
+      const HardklorPeak *pPeaks = hkFile.GetPeaks(scan);
+
+      if (scan.iScanNumber != vScans[i].iScanNumber || scan.iNumPeaks != vScans[i].iNumPeaks)
+      {
+         if (lNumDiffs++ < 10)
+            printf(" scan %d differs: %d/%d peaks vs %d/%d\n", i, vScans[i].iScanNumber, vScans[i].iNumPeaks,
+                  scan.iScanNumber, scan.iNumPeaks);
+         continue;
+      }
+
+      for (ii=0; ii<scan.iNumPeaks; ii++)
+      {
+         const HardklorPeak &peak = vPeaks[vScans[i].lFirstPeak + ii];
+
+         // masses must match bit for bit, not just within a tolerance
+         if (memcmp(&peak.dNeutralMass, &pPeaks[ii].dNeutralMass, sizeof(double))
+               || peak.iCharge != pPeaks[ii].iCharge
+               || peak.iIntensity != pPeaks[ii].iIntensity)
+         {
+            if (lNumDiffs++ < 10)
+               printf(" scan %d peak %d differs: %0.17g %d %d vs %0.17g %d %d\n", vScans[i].iScanNumber, ii,
+                     peak.dNeutralMass, peak.iCharge, peak.iIntensity,
+                     pPeaks[ii].dNeutralMass, pPeaks[ii].iCharge, pPeaks[ii].iIntensity);
+         }
+      }
+   }
+
+   return lNumDiffs;
+}
+
+
+static double Seconds(std::chrono::steady_clock::time_point tStart)
+{
+   return std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+}
+
+
+int main(int argc, char *argv[])
+{
+   long lNumLines = HK_BENCH_LINES;
+   const char *szFile = HK_BENCH_FILE;
+   long lNumFallback;
+   double dOld = 0.0;
+   double dNew = 0.0;
+   int i;
+
+   if (argc > 1)
+      lNumLines = atol(argv[1]);
+   if (argc > 2)
+      szFile = argv[2];
+
+   if (lNumLines <= 0)
+   {
+      printf(" Usage:  hk-bench [number of lines] [synthetic file]\n");
+      return 1;
+   }
+
+   printf(" writing %ld lines to %s ... ", lNumLines, szFile); fflush(stdout);
+   if (!WriteSyntheticFile(szFile, lNumLines, &lNumFallback))
+   {
+      printf("\n Error - cannot write %s\n", szFile);
+      return 1;
+   }
+   printf("done; %ld masses take the strtod fallback\n", lNumFallback);
+
+   vector<HardklorScan> vScans;
+   vector<HardklorPeak> vPeaks;
+   mango_HardklorFile hkFile;
+
+   for (i=0; i<HK_BENCH_REPEAT; i++)
+   {
+      std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+      if (!ReadOld(szFile, vScans, vPeaks))
+      {
+         printf(" Error - cannot read %s\n", szFile);
+         return 1;
+      }
+      double dTime = Seconds(tStart);
+      if (i == 0 || dTime < dOld)
+         dOld = dTime;
+
+      tStart = std::chrono::steady_clock::now();
+      mango_HardklorFile hkRun;
+      if (!hkRun.Load(szFile, false))
+      {
+         printf(" Error - cannot read %s\n", szFile);
+         return 1;
+      }
+      dTime = Seconds(tStart);
+      if (i == 0 || dTime < dNew)
+         dNew = dTime;
+   }
+
+   hkFile.Load(szFile, false);
+   long lNumDiffs = Compare(vScans, vPeaks, hkFile);
+
+   printf(" %d scans, %d peaks\n", (int)vScans.size(), (int)vPeaks.size());
+   printf(" fgets/sscanf reader:  %0.3f s\n", dOld);
+   printf(" mango_HardklorFile:   %0.3f s  (%0.1fx)\n", dNew, dOld/dNew);
+   printf(" %ld differences\n", lNumDiffs);
+
+   remove(szFile);
+
+   return (lNumDiffs == 0 ? 0 : 1);
+}
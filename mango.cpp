@@ -189,6 +189,8 @@ void PrintParams(void)
    fprintf(fp, "# mango_version %s\n", mango_version);
    fprintf(fp, "fasta_file = /some/path/db.fasta\n");
    fprintf(fp, "fasta_hash = /some/path/db.fasta.hash            # if exits, use hash; if not create hash from fasta\n");
+   fprintf(fp, "hardklor_isotope_data = %s                 # Hardklor data files; used only when .hk1/.hk2 files must be generated\n", g_staticParams.options.szHardklorIsotopeData);
+   fprintf(fp, "hardklor_data = %s\n", g_staticParams.options.szHardklorData);
    fprintf(fp, "mass_tolerance_relationship = %0.2f              # PPM units; intact crosslink vs. 751 + mass1 + mass2\n", g_staticParams.tolerances.dToleranceRelationship);
    fprintf(fp, "mass_tolerance_peptide = %0.2f                   # PPM units; mass1 vs. retrieved peptides from database\n", g_staticParams.tolerances.dTolerancePeptide);
    fprintf(fp, "mass_tolerance_fragment = %0.2f                   # Da bin size\n", g_staticParams.tolerances.dFragmentBinSize);
@@ -198,6 +200,9 @@ void PrintParams(void)
    fprintf(fp, "reported_score = %d                              # # 0=worst E-value; 1=combined E-value\n", g_staticParams.options.iReportedScore);
    fprintf(fp, "silac_heavy = %d                                 # 0=normal/light search; 1=SILAC heavy search\n", g_staticParams.options.iSilacHeavy);
    fprintf(fp, "dump_relationship_data = %d                      # 0=no, 1=yes, 2=yes but do not do search\n", g_staticParams.options.iDumpRelationshipData);
+   fprintf(fp, "num_threads = %d                                 # 0=poll CPU to set num threads; else specify num threads directly\n", g_staticParams.options.iNumThreads);
+   fprintf(fp, "exact_combined_histogram = %d                    # 0=convolve pep1/pep2 score histograms; 1=score every pep1/pep2 pair (slow, for validation)\n", g_staticParams.options.iExactCombinedHistogram);
+   fprintf(fp, "float_preprocessing = %d                         # 0=double precision spectrum preprocessing; 1=single precision; 2=single, report max xcorr deviation from double\n", g_staticParams.options.iFloatPreprocessing);
    fprintf(fp, "#variable mod format:  <mass>  <residues>  <required>  <internal>\n");
    fprintf(fp, "variable_mod01 = 15.9949 M 0 0\n");
    fprintf(fp, "variable_mod02 = 197.032422 K 1 1\n");
@@ -330,6 +335,26 @@ void LoadParameters(char *pszParamsFile,
                strcpy(szFile, szParamVal);
                pSearchMgr->SetParam("fasta_hash", szFile, szFile);
             }
+            else if (!strcmp(szParamName, "hardklor_isotope_data") || !strcmp(szParamName, "hardklor_data"))
+            {
+               char szFile[512];
+               // Remove white spaces at beginning/end of szParamVal
+               int iLen = strlen(szParamVal);
+               char *szTrimmed = szParamVal;
+
+               while (isspace(szTrimmed[iLen -1]))  // trim end
+                  szTrimmed[--iLen] = 0;
+               while (*szTrimmed && isspace(*szTrimmed))  // trim beginning
+               {
+                  ++szTrimmed;
+                  --iLen;
+               }
+
+               memmove(szParamVal, szTrimmed, iLen+1);
+
+               strcpy(szFile, szParamVal);
+               pSearchMgr->SetParam(szParamName, szFile, szFile);
+            }
             else if (!strcmp(szParamName, "mass_tolerance_relationship"))
             {  
                sscanf(szParamVal, "%lf", &dDoubleParam);
@@ -393,6 +418,27 @@ void LoadParameters(char *pszParamsFile,
                sprintf(szParamStringVal, "%d", iIntParam); 
                pSearchMgr->SetParam("dump_relationship_data", szParamStringVal, iIntParam);
             }
+            else if (!strcmp(szParamName, "num_threads"))
+            {  
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam); 
+               pSearchMgr->SetParam("num_threads", szParamStringVal, iIntParam);
+            }
+            else if (!strcmp(szParamName, "exact_combined_histogram"))
+            {  
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam); 
+               pSearchMgr->SetParam("exact_combined_histogram", szParamStringVal, iIntParam);
+            }
+            else if (!strcmp(szParamName, "float_preprocessing"))
+            {  
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam); 
+               pSearchMgr->SetParam("float_preprocessing", szParamStringVal, iIntParam);
+            }
             else
             {
                sprintf(szErrorMsg, " Warning - invalid parameter found: %s.  Parameter will be ignored.\n", szParamName);
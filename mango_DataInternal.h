@@ -17,6 +17,8 @@
 
 #include "mango_Data.h"
 
+#include <memory>
+
 class MangoSearchManager;
 
 #define PROTON_MASS                 1.00727646688
@@ -95,6 +97,8 @@ struct Options             // output parameters
    int iReportedScore;
    int iSilacHeavy;
    int iDumpRelationshipData;
+   int iExactCombinedHistogram;  // 0=convolve pep1/pep2 histograms; 1=score every pep1/pep2 pair
+   int iFloatPreprocessing;      // 0=double preprocessing; 1=float; 2=float checked against double
    double dMinIntensity;
    double dRemovePrecursorTol;
    double dPeptideMassLow;       // MH+ mass
@@ -105,6 +109,8 @@ struct Options             // output parameters
    IntRange scanRange;
    DoubleRange clearMzRange;
    char szActivationMethod[24];  // mzXML only
+   char szHardklorIsotopeData[SIZE_FILE];   // ISOTOPE.DAT used when Hardklor is run
+   char szHardklorData[SIZE_FILE];          // Hardklor.dat used when Hardklor is run
 
    Options& operator=(Options& a)
    {
@@ -144,7 +150,11 @@ struct Options             // output parameters
       iReportedScore = a.iReportedScore;
       iSilacHeavy = a.iSilacHeavy;
       iDumpRelationshipData = a.iDumpRelationshipData;
+      iExactCombinedHistogram = a.iExactCombinedHistogram;
+      iFloatPreprocessing = a.iFloatPreprocessing;
       strcpy(szActivationMethod, a.szActivationMethod);
+      strcpy(szHardklorIsotopeData, a.szHardklorIsotopeData);
+      strcpy(szHardklorData, a.szHardklorData);
 
       return *this;
    }
@@ -530,6 +540,10 @@ struct StaticParams
       options.iReportedScore = 0;
       options.iSilacHeavy = 0;
       options.iDumpRelationshipData= 0;
+      options.iExactCombinedHistogram = 0;
+      options.iFloatPreprocessing = 0;
+      strcpy(options.szHardklorIsotopeData, "ISOTOPE.DAT");
+      strcpy(options.szHardklorData, "Hardklor.dat");
 
       options.clearMzRange.dStart = 0.0;
       options.clearMzRange.dEnd = 0.0;
@@ -587,6 +601,32 @@ struct SparseMatrix
    float fIntensity;
 };
 
+// Sparse fast xcorr spectrum shared by every charge state of a scan
+struct SparseFastXcorrData
+{
+   int iFastXcorrData;
+   float **ppfSparseFastXcorrData;
+
+   SparseFastXcorrData()
+   {
+      iFastXcorrData = 0;
+      ppfSparseFastXcorrData = NULL;
+   }
+
+   ~SparseFastXcorrData()
+   {
+      int i;
+
+      for (i=0;i<iFastXcorrData;i++)
+      {
+         if (ppfSparseFastXcorrData[i] != NULL)
+            delete[] ppfSparseFastXcorrData[i];
+      }
+      delete[] ppfSparseFastXcorrData;
+      ppfSparseFastXcorrData = NULL;
+   }
+};
+
 // Query stores information for peptide scoring and results
 // This struct is allocated for each spectrum/charge combination
 struct Query
@@ -612,9 +652,15 @@ struct Query
    unsigned long int  _uliNumMatchedPeptides;
    unsigned long int  _uliNumMatchedDecoyPeptides;
 
-   // Sparse matrix representation of data
+   // Sparse matrix representation of data; iFastXcorrData and ppfSparseFastXcorrData
+   // point into pFastXcorrData, which may be shared with other charge states.
    int iFastXcorrData;  //MH: I believe these are all the same size now.
    float **ppfSparseFastXcorrData;
+   std::shared_ptr<SparseFastXcorrData> pFastXcorrData;
+   float **ppfCheckFastXcorrData;   // double precision spectrum when float_preprocessing = 2
+   std::shared_ptr<SparseFastXcorrData> pCheckFastXcorrData;
+   double dMaxCheckDeviation;       // largest |xcorr - xcorr from ppfCheckFastXcorrData| seen
+   unordered_map<uint64_t, double> mapXcorrMemo;   // xcorr of hash database peptides (by id) already scored
 
    PepMassInfo          _pepMassInfo;
    SpectrumInfoInternal _spectrumInfoInternal;
@@ -648,7 +694,10 @@ struct Query
       _uliNumMatchedPeptides = 0;
       _uliNumMatchedDecoyPeptides = 0;
 
+      iFastXcorrData = 0;
       ppfSparseFastXcorrData = NULL;
+      ppfCheckFastXcorrData = NULL;
+      dMaxCheckDeviation = 0.0;
 
       _pepMassInfo.dCalcPepMass = 0.0;
       _pepMassInfo.dExpPepMass = 0.0;
@@ -668,16 +717,6 @@ struct Query
 
    ~Query()
    {
-      int i;
-
-      for (i=0;i<iFastXcorrData;i++)
-      {
-         if (ppfSparseFastXcorrData[i] != NULL)
-            delete[] ppfSparseFastXcorrData[i];
-      }
-      delete[] ppfSparseFastXcorrData;
-      ppfSparseFastXcorrData = NULL;
-
       delete[] _pResults;
       _pResults = NULL;
 
@@ -689,7 +728,37 @@ struct Query
    }
 };
 
-extern vector<Query*>          g_pvQuery;
+// Preprocessed data of the scan being searched, one Query per precursor charge
+// state listed for the spectrum.  Passed explicitly to the scoring routines.
+struct QueryContext
+{
+   int iScanNumber;
+   vector<Query*> vpQuery;
+
+   QueryContext()
+   {
+      iScanNumber = 0;
+   }
+
+   ~QueryContext()
+   {
+      for (int i=0; i<(int)vpQuery.size(); i++)
+         delete vpQuery.at(i);
+   }
+
+   // Each charge state's arrays are sized by its own precursor mass so return the
+   // first query large enough to hold fragment ions of a peptide of dNeutralMass.
+   Query *GetQuery(double dNeutralMass)
+   {
+      for (int i=0; i<(int)vpQuery.size(); i++)
+      {
+         if (vpQuery.at(i)->_pepMassInfo.dExpPepMass >= dNeutralMass)
+            return vpQuery.at(i);
+      }
+
+      return (vpQuery.empty() ? NULL : vpQuery.at(0));
+   }
+};
 extern vector<InputFileInfo*>  g_pvInputFiles;
 
 struct IonSeriesStruct         // defines which fragment ion series are considered
@@ -0,0 +1,474 @@
+/*
+   Copyright 2017 University of Washington                          3-clause BSD license
+
+   Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+   3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//  Fast xcorr transform of a binned spectrum: sliding window mean and flanking
+//  peaks, with SSE2 and AVX kernels picked at run time.
+//
+//  Every kernel performs the same IEEE operations on each element, so results
+//  are bit identical whichever kernel runs.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "Common.h"
+#include "mango_FastXcorr.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MANGO_X86_SIMD
+#endif
+
+
+int mango_FastXcorr::GetKernel()
+{
+#ifdef MANGO_X86_SIMD
+   static const int iKernel = (__builtin_cpu_supports("avx") ? FASTXCORR_KERNEL_AVX
+         : (__builtin_cpu_supports("sse2") ? FASTXCORR_KERNEL_SSE2 : FASTXCORR_KERNEL_SCALAR));
+
+   return iKernel;
+#else
+   return FASTXCORR_KERNEL_SCALAR;
+#endif
+}
+
+
+bool mango_FastXcorr::IsKernelSupported(int iKernel)
+{
+   if (iKernel == FASTXCORR_KERNEL_SCALAR)
+      return true;
+
+#ifdef MANGO_X86_SIMD
+   if (iKernel == FASTXCORR_KERNEL_SSE2)
+      return __builtin_cpu_supports("sse2");
+   if (iKernel == FASTXCORR_KERNEL_AVX)
+      return __builtin_cpu_supports("avx");
+#endif
+
+   return false;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Windowed mean
+//
+//  A single running sum is one long chain of dependent additions.  The spectrum
+//  is instead cut into FASTXCORR_WINDOW_LANES segments, each starting from its own
+//  directly summed window, and the segments' running sums advance together in one
+//  vector.  The first segment is exactly the original running sum; the others
+//  differ from it only by the rounding of their starting window.
+///////////////////////////////////////////////////////////////////////////////
+
+// Moves dSum from the window of bin k to the window of bin k+1 and writes bin k+1.
+template <typename T>
+static inline void mango_window_step(const T *pCorr,
+                                     T *pMean,
+                                     int iArraySize,
+                                     int iOffset,
+                                     double dTmp,
+                                     double &dSum,
+                                     int k)
+{
+   if (k+iOffset+1 < iArraySize)
+      dSum += pCorr[k+iOffset+1];
+   if (k-iOffset >= 0)
+      dSum -= pCorr[k-iOffset];
+
+   pMean[k+1] = (T)((dSum - pCorr[k+1])*dTmp);
+}
+
+#ifdef MANGO_X86_SIMD
+// Steps [iStart, iStop) of all four segments; every window is inside the spectrum.
+template <typename T>
+static void mango_window_sse2(const T *pCorr,
+                              T *pMean,
+                              int iSegmentSize,
+                              int iOffset,
+                              double dTmp,
+                              double *pdSum,
+                              int iStart,
+                              int iStop)
+{
+   const T *p0 = pCorr;
+   const T *p1 = pCorr + iSegmentSize;
+   const T *p2 = pCorr + 2*iSegmentSize;
+   const T *p3 = pCorr + 3*iSegmentSize;
+   __m128d vSum01 = _mm_loadu_pd(pdSum);
+   __m128d vSum23 = _mm_loadu_pd(pdSum+2);
+   const __m128d vTmp = _mm_set1_pd(dTmp);
+   double pdOut[4];
+
+   for (int s=iStart; s<iStop; s++)
+   {
+      int iAdd = s+iOffset+1;
+      int iSub = s-iOffset;
+      int iBin = s+1;
+
+      vSum01 = _mm_sub_pd(_mm_add_pd(vSum01, _mm_set_pd(p1[iAdd], p0[iAdd])), _mm_set_pd(p1[iSub], p0[iSub]));
+      vSum23 = _mm_sub_pd(_mm_add_pd(vSum23, _mm_set_pd(p3[iAdd], p2[iAdd])), _mm_set_pd(p3[iSub], p2[iSub]));
+
+      _mm_storeu_pd(pdOut, _mm_mul_pd(_mm_sub_pd(vSum01, _mm_set_pd(p1[iBin], p0[iBin])), vTmp));
+      _mm_storeu_pd(pdOut+2, _mm_mul_pd(_mm_sub_pd(vSum23, _mm_set_pd(p3[iBin], p2[iBin])), vTmp));
+
+      pMean[iBin] = (T)pdOut[0];
+      pMean[iSegmentSize+iBin] = (T)pdOut[1];
+      pMean[2*iSegmentSize+iBin] = (T)pdOut[2];
+      pMean[3*iSegmentSize+iBin] = (T)pdOut[3];
+   }
+
+   _mm_storeu_pd(pdSum, vSum01);
+   _mm_storeu_pd(pdSum+2, vSum23);
+}
+
+template <typename T>
+__attribute__((target("avx")))
+static void mango_window_avx(const T *pCorr,
+                             T *pMean,
+                             int iSegmentSize,
+                             int iOffset,
+                             double dTmp,
+                             double *pdSum,
+                             int iStart,
+                             int iStop)
+{
+   const T *p0 = pCorr;
+   const T *p1 = pCorr + iSegmentSize;
+   const T *p2 = pCorr + 2*iSegmentSize;
+   const T *p3 = pCorr + 3*iSegmentSize;
+   __m256d vSum = _mm256_loadu_pd(pdSum);
+   const __m256d vTmp = _mm256_set1_pd(dTmp);
+   double pdOut[4];
+
+   for (int s=iStart; s<iStop; s++)
+   {
+      int iAdd = s+iOffset+1;
+      int iSub = s-iOffset;
+      int iBin = s+1;
+
+      vSum = _mm256_sub_pd(_mm256_add_pd(vSum, _mm256_set_pd(p3[iAdd], p2[iAdd], p1[iAdd], p0[iAdd])),
+            _mm256_set_pd(p3[iSub], p2[iSub], p1[iSub], p0[iSub]));
+
+      _mm256_storeu_pd(pdOut, _mm256_mul_pd(_mm256_sub_pd(vSum, _mm256_set_pd(p3[iBin], p2[iBin], p1[iBin], p0[iBin])), vTmp));
+
+      pMean[iBin] = (T)pdOut[0];
+      pMean[iSegmentSize+iBin] = (T)pdOut[1];
+      pMean[2*iSegmentSize+iBin] = (T)pdOut[2];
+      pMean[3*iSegmentSize+iBin] = (T)pdOut[3];
+   }
+
+   _mm256_storeu_pd(pdSum, vSum);
+}
+#endif
+
+
+template <typename T>
+static void mango_windowed_mean(const T *pCorr,
+                                T *pMean,
+                                int iArraySize,
+                                int iOffset,
+                                int iKernel)
+{
+   int i;
+   int j;
+   int iTmpRange = 2*iOffset + 1;
+   double dTmp = 1.0 / (double)(iTmpRange - 1);
+   int iSegmentSize = iArraySize / FASTXCORR_WINDOW_LANES;
+   int iNumSegments = FASTXCORR_WINDOW_LANES;
+   int piStart[FASTXCORR_WINDOW_LANES];
+   int piStop[FASTXCORR_WINDOW_LANES];
+   double pdSum[FASTXCORR_WINDOW_LANES];
+
+   if (iArraySize < 1)
+      return;
+
+   if (iSegmentSize < 2)
+   {
+      iNumSegments = 1;
+      iSegmentSize = iArraySize;
+   }
+
+   // first bin of each segment from its directly summed window; the last segment
+   // also takes the bins left over by the division
+   for (j=0; j<iNumSegments; j++)
+   {
+      int iLow;
+      int iHigh;
+
+      piStart[j] = j*iSegmentSize;
+      piStop[j] = (j == iNumSegments-1 ? iArraySize : piStart[j] + iSegmentSize);
+
+      iLow = (piStart[j]-iOffset > 0 ? piStart[j]-iOffset : 0);
+      iHigh = (piStart[j]+iOffset < iArraySize-1 ? piStart[j]+iOffset : iArraySize-1);
+
+      pdSum[j] = 0.0;
+      for (i=iLow; i<=iHigh; i++)
+         pdSum[j] += pCorr[i];
+
+      pMean[piStart[j]] = (T)((pdSum[j] - pCorr[piStart[j]])*dTmp);
+   }
+
+   // Steps [iVectorStart, iVectorStop) need no bounds checks in any segment: the
+   // first segment's window has left bin 0 and the last segment's has not reached
+   // the end of the spectrum.
+   int iVectorStart = iOffset;
+   int iVectorStop = iArraySize - piStart[iNumSegments-1] - iOffset - 1;
+
+   if (iVectorStop > iSegmentSize-1)
+      iVectorStop = iSegmentSize-1;
+
+   if (iNumSegments != FASTXCORR_WINDOW_LANES || iKernel == FASTXCORR_KERNEL_SCALAR || iVectorStop <= iVectorStart)
+   {
+      iVectorStart = 0;
+      iVectorStop = 0;
+   }
+
+   for (j=0; j<iNumSegments; j++)
+   {
+      for (i=piStart[j]; i<piStart[j]+iVectorStart; i++)
+         mango_window_step(pCorr, pMean, iArraySize, iOffset, dTmp, pdSum[j], i);
+   }
+
+#ifdef MANGO_X86_SIMD
+   if (iVectorStop > iVectorStart)
+   {
+      if (iKernel == FASTXCORR_KERNEL_AVX)
+         mango_window_avx(pCorr, pMean, iSegmentSize, iOffset, dTmp, pdSum, iVectorStart, iVectorStop);
+      else
+         mango_window_sse2(pCorr, pMean, iSegmentSize, iOffset, dTmp, pdSum, iVectorStart, iVectorStop);
+   }
+#endif
+
+   for (j=0; j<iNumSegments; j++)
+   {
+      for (i=piStart[j]+iVectorStop; i<piStop[j]-1; i++)
+         mango_window_step(pCorr, pMean, iArraySize, iOffset, dTmp, pdSum[j], i);
+   }
+}
+
+
+void mango_FastXcorr::MakeWindowedMean(const double *pdCorrelationData,
+                                       double *pdWindowedMean,
+                                       int iArraySize,
+                                       int iOffset,
+                                       int iKernel)
+{
+   mango_windowed_mean(pdCorrelationData, pdWindowedMean, iArraySize, iOffset, iKernel);
+}
+
+
+void mango_FastXcorr::MakeWindowedMean(const float *pfCorrelationData,
+                                       float *pfWindowedMean,
+                                       int iArraySize,
+                                       int iOffset,
+                                       int iKernel)
+{
+   mango_windowed_mean(pfCorrelationData, pfWindowedMean, iArraySize, iOffset, iKernel);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Flanking peaks
+///////////////////////////////////////////////////////////////////////////////
+
+// pfOut[i] = (float)d[i] (+ (float)(d[i-1]*0.5) + (float)(d[i+1]*0.5) with flanking
+// peaks) for i in [iStart, iStop) where d = pCorr - pMean.
+template <typename T>
+static void mango_flank_scalar(const T *pCorr,
+                               const T *pMean,
+                               float *pfOut,
+                               int iStart,
+                               int iStop,
+                               bool bFlanking)
+{
+   for (int i=iStart; i<iStop; i++)
+   {
+      pfOut[i] = (float)(pCorr[i] - pMean[i]);
+
+      if (bFlanking)
+      {
+         pfOut[i] += (float)((pCorr[i-1] - pMean[i-1])*0.5);
+         pfOut[i] += (float)((pCorr[i+1] - pMean[i+1])*0.5);
+      }
+   }
+}
+
+#ifdef MANGO_X86_SIMD
+static void mango_flank_sse2(const double *pdCorr,
+                             const double *pdMean,
+                             float *pfOut,
+                             int iStart,
+                             int iStop,
+                             bool bFlanking)
+{
+   const __m128d vHalf = _mm_set1_pd(0.5);
+   int i = iStart;
+
+   for ( ; i+2<=iStop; i+=2)
+   {
+      __m128 vOut = _mm_cvtpd_ps(_mm_sub_pd(_mm_loadu_pd(pdCorr+i), _mm_loadu_pd(pdMean+i)));
+
+      if (bFlanking)
+      {
+         __m128d vPrev = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(pdCorr+i-1), _mm_loadu_pd(pdMean+i-1)), vHalf);
+         __m128d vNext = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(pdCorr+i+1), _mm_loadu_pd(pdMean+i+1)), vHalf);
+
+         vOut = _mm_add_ps(vOut, _mm_cvtpd_ps(vPrev));
+         vOut = _mm_add_ps(vOut, _mm_cvtpd_ps(vNext));
+      }
+
+      _mm_storel_pi((__m64 *)(pfOut+i), vOut);
+   }
+
+   mango_flank_scalar(pdCorr, pdMean, pfOut, i, iStop, bFlanking);
+}
+
+// Single precision: d*0.5 is exact in float just as in double so the float
+// multiply gives the same result as the scalar loop's conversion.
+static void mango_flank_sse2(const float *pfCorr,
+                             const float *pfMean,
+                             float *pfOut,
+                             int iStart,
+                             int iStop,
+                             bool bFlanking)
+{
+   const __m128 vHalf = _mm_set1_ps(0.5f);
+   int i = iStart;
+
+   for ( ; i+4<=iStop; i+=4)
+   {
+      __m128 vOut = _mm_sub_ps(_mm_loadu_ps(pfCorr+i), _mm_loadu_ps(pfMean+i));
+
+      if (bFlanking)
+      {
+         vOut = _mm_add_ps(vOut, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(pfCorr+i-1), _mm_loadu_ps(pfMean+i-1)), vHalf));
+         vOut = _mm_add_ps(vOut, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(pfCorr+i+1), _mm_loadu_ps(pfMean+i+1)), vHalf));
+      }
+
+      _mm_storeu_ps(pfOut+i, vOut);
+   }
+
+   mango_flank_scalar(pfCorr, pfMean, pfOut, i, iStop, bFlanking);
+}
+
+__attribute__((target("avx")))
+static void mango_flank_avx(const double *pdCorr,
+                            const double *pdMean,
+                            float *pfOut,
+                            int iStart,
+                            int iStop,
+                            bool bFlanking)
+{
+   const __m256d vHalf = _mm256_set1_pd(0.5);
+   int i = iStart;
+
+   for ( ; i+4<=iStop; i+=4)
+   {
+      __m128 vOut = _mm256_cvtpd_ps(_mm256_sub_pd(_mm256_loadu_pd(pdCorr+i), _mm256_loadu_pd(pdMean+i)));
+
+      if (bFlanking)
+      {
+         __m256d vPrev = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(pdCorr+i-1), _mm256_loadu_pd(pdMean+i-1)), vHalf);
+         __m256d vNext = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(pdCorr+i+1), _mm256_loadu_pd(pdMean+i+1)), vHalf);
+
+         vOut = _mm_add_ps(vOut, _mm256_cvtpd_ps(vPrev));
+         vOut = _mm_add_ps(vOut, _mm256_cvtpd_ps(vNext));
+      }
+
+      _mm_storeu_ps(pfOut+i, vOut);
+   }
+
+   mango_flank_scalar(pdCorr, pdMean, pfOut, i, iStop, bFlanking);
+}
+
+__attribute__((target("avx")))
+static void mango_flank_avx(const float *pfCorr,
+                            const float *pfMean,
+                            float *pfOut,
+                            int iStart,
+                            int iStop,
+                            bool bFlanking)
+{
+   const __m256 vHalf = _mm256_set1_ps(0.5f);
+   int i = iStart;
+
+   for ( ; i+8<=iStop; i+=8)
+   {
+      __m256 vOut = _mm256_sub_ps(_mm256_loadu_ps(pfCorr+i), _mm256_loadu_ps(pfMean+i));
+
+      if (bFlanking)
+      {
+         vOut = _mm256_add_ps(vOut, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(pfCorr+i-1), _mm256_loadu_ps(pfMean+i-1)), vHalf));
+         vOut = _mm256_add_ps(vOut, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(pfCorr+i+1), _mm256_loadu_ps(pfMean+i+1)), vHalf));
+      }
+
+      _mm256_storeu_ps(pfOut+i, vOut);
+   }
+
+   mango_flank_scalar(pfCorr, pfMean, pfOut, i, iStop, bFlanking);
+}
+#endif
+
+
+template <typename T>
+static void mango_fast_xcorr_data(const T *pCorr,
+                                  const T *pMean,
+                                  float *pfFastXcorrData,
+                                  int iArraySize,
+                                  bool bFlanking,
+                                  int iKernel)
+{
+   if (iArraySize < 1)
+      return;
+
+   pfFastXcorrData[0] = 0.0;
+
+   // the last bin has no right hand neighbor
+#ifdef MANGO_X86_SIMD
+   if (iKernel == FASTXCORR_KERNEL_AVX)
+      mango_flank_avx(pCorr, pMean, pfFastXcorrData, 1, iArraySize-1, bFlanking);
+   else if (iKernel == FASTXCORR_KERNEL_SSE2)
+      mango_flank_sse2(pCorr, pMean, pfFastXcorrData, 1, iArraySize-1, bFlanking);
+   else
+#endif
+      mango_flank_scalar(pCorr, pMean, pfFastXcorrData, 1, iArraySize-1, bFlanking);
+
+   if (iArraySize > 1)
+   {
+      int i = iArraySize-1;
+
+      pfFastXcorrData[i] = (float)(pCorr[i] - pMean[i]);
+      if (bFlanking)
+         pfFastXcorrData[i] += (float)((pCorr[i-1] - pMean[i-1])*0.5);
+   }
+}
+
+
+void mango_FastXcorr::MakeFastXcorrData(const double *pdCorrelationData,
+                                        const double *pdWindowedMean,
+                                        float *pfFastXcorrData,
+                                        int iArraySize,
+                                        bool bFlanking,
+                                        int iKernel)
+{
+   mango_fast_xcorr_data(pdCorrelationData, pdWindowedMean, pfFastXcorrData, iArraySize, bFlanking, iKernel);
+}
+
+
+void mango_FastXcorr::MakeFastXcorrData(const float *pfCorrelationData,
+                                        const float *pfWindowedMean,
+                                        float *pfFastXcorrData,
+                                        int iArraySize,
+                                        bool bFlanking,
+                                        int iKernel)
+{
+   mango_fast_xcorr_data(pfCorrelationData, pfWindowedMean, pfFastXcorrData, iArraySize, bFlanking, iKernel);
+}
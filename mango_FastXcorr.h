@@ -0,0 +1,65 @@
+/*
+   Copyright 2017 University of Washington                          3-clause BSD license
+
+   Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+   3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//  Fast xcorr transform of a binned spectrum: sliding window mean and flanking
+//  peaks, with SSE2 and AVX kernels picked at run time.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef _MANGOFASTXCORR_H_
+#define _MANGOFASTXCORR_H_
+
+#define FASTXCORR_KERNEL_SCALAR  0
+#define FASTXCORR_KERNEL_SSE2    1
+#define FASTXCORR_KERNEL_AVX     2
+
+#define FASTXCORR_WINDOW_LANES   4    // spectrum segments whose running sums advance together
+
+class mango_FastXcorr
+{
+public:
+   // Fastest kernel the running CPU supports; checked once.
+   static int GetKernel();
+   static bool IsKernelSupported(int iKernel);
+
+   // pdWindowedMean[k] = mean of pdCorrelationData over bins k-iOffset..k+iOffset
+   // (clipped to the spectrum), excluding bin k itself.
+   static void MakeWindowedMean(const double *pdCorrelationData,
+                                double *pdWindowedMean,
+                                int iArraySize,
+                                int iOffset,
+                                int iKernel);
+   static void MakeWindowedMean(const float *pfCorrelationData,
+                                float *pfWindowedMean,
+                                int iArraySize,
+                                int iOffset,
+                                int iKernel);
+
+   // pfFastXcorrData[k] = d[k] (+ d[k-1]/2 + d[k+1]/2 with flanking peaks) where
+   // d = correlation data - windowed mean; bin 0 is zero.
+   static void MakeFastXcorrData(const double *pdCorrelationData,
+                                 const double *pdWindowedMean,
+                                 float *pfFastXcorrData,
+                                 int iArraySize,
+                                 bool bFlanking,
+                                 int iKernel);
+   static void MakeFastXcorrData(const float *pfCorrelationData,
+                                 const float *pfWindowedMean,
+                                 float *pfFastXcorrData,
+                                 int iArraySize,
+                                 bool bFlanking,
+                                 int iKernel);
+};
+
+#endif // _MANGOFASTXCORR_H_
@@ -0,0 +1,419 @@
+/*
+   Copyright 2017 University of Washington                          3-clause BSD license
+
+   Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+   3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//  Reader for Hardklor .hk1/.hk2 results with a binary sidecar cache.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "Common.h"
+#include "mango_DataInternal.h"
+#include "mango_Hardklor.h"
+
+#include <fcntl.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+
+mango_HardklorFile::mango_HardklorFile()
+{
+   _pMapBase = NULL;
+   _lMapSize = 0;
+   _pScans = NULL;
+   _pPeaks = NULL;
+   _lNumScans = 0;
+   _lNumPeaks = 0;
+}
+
+
+mango_HardklorFile::~mango_HardklorFile()
+{
+   Unmap();
+}
+
+
+void mango_HardklorFile::Unmap()
+{
+   if (_pMapBase == NULL)
+      return;
+
+#ifdef _WIN32
+   delete[] _pMapBase;
+#else
+   munmap((void *)_pMapBase, _lMapSize);
+#endif
+
+   _pMapBase = NULL;
+   _lMapSize = 0;
+   _pScans = NULL;
+   _pPeaks = NULL;
+   _lNumScans = 0;
+   _lNumPeaks = 0;
+}
+
+
+// Returns false only if the .hk text file cannot be read.  With bUseCache false the
+// text file is always parsed and no sidecar is read or written.
+bool mango_HardklorFile::Load(const char *szHK,
+                              bool bUseCache)
+{
+   struct stat st;
+   char szCache[SIZE_FILE];
+
+   if (stat(szHK, &st) != 0)
+      return false;
+
+   if (!bUseCache)
+      return ParseText(szHK);
+
+   snprintf(szCache, sizeof(szCache), "%s%s", szHK, HK_CACHE_EXT);
+
+   if (MapCache(szCache, (uint64_t)st.st_size, (int64_t)st.st_mtime))
+      return true;
+
+   if (!ParseText(szHK))
+      return false;
+
+   WriteCache(szCache, (uint64_t)st.st_size, (int64_t)st.st_mtime);
+
+   return true;
+}
+
+
+bool mango_HardklorFile::MapCache(const char *szCache,
+                                  uint64_t lSourceSize,
+                                  int64_t lSourceMtime)
+{
+   struct stat st;
+   int fd;
+
+   if ((fd = open(szCache, O_RDONLY)) < 0)
+      return false;
+
+   if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(HardklorCacheHeader))
+   {
+      close(fd);
+      return false;
+   }
+
+   _lMapSize = st.st_size;
+#ifdef _WIN32
+   char *pBuf = new char[_lMapSize];
+   if (read(fd, pBuf, _lMapSize) != (int)_lMapSize)
+   {
+      delete[] pBuf;
+      close(fd);
+      _lMapSize = 0;
+      return false;
+   }
+   _pMapBase = pBuf;
+#else
+   void *pMap = mmap(NULL, _lMapSize, PROT_READ, MAP_SHARED, fd, 0);
+   if (pMap == MAP_FAILED)
+   {
+      close(fd);
+      _lMapSize = 0;
+      return false;
+   }
+   _pMapBase = (const char *)pMap;
+#endif
+   close(fd);
+
+   const HardklorCacheHeader *pHdr = (const HardklorCacheHeader *)_pMapBase;
+
+   if (memcmp(pHdr->szMagic, HK_CACHE_MAGIC, sizeof(HK_CACHE_MAGIC))
+         || pHdr->iVersion != HK_CACHE_VERSION
+         || pHdr->lSourceSize != lSourceSize
+         || pHdr->lSourceMtime != lSourceMtime
+         || pHdr->lFileSize != _lMapSize
+         || pHdr->lNumScans > _lMapSize / sizeof(HardklorScan)
+         || pHdr->lNumPeaks > _lMapSize / sizeof(HardklorPeak)
+         || pHdr->lFileSize != sizeof(HardklorCacheHeader)
+               + pHdr->lNumScans*sizeof(HardklorScan) + pHdr->lNumPeaks*sizeof(HardklorPeak))
+   {
+      Unmap();
+      return false;
+   }
+
+   _lNumScans = pHdr->lNumScans;
+   _lNumPeaks = pHdr->lNumPeaks;
+   _pScans = (const HardklorScan *)(_pMapBase + sizeof(HardklorCacheHeader));
+   _pPeaks = (const HardklorPeak *)(_pMapBase + sizeof(HardklorCacheHeader) + _lNumScans*sizeof(HardklorScan));
+
+   // GetPeaks trusts each scan's peak range, so a damaged scan table means reparsing
+   for (uint64_t i=0; i<_lNumScans; i++)
+   {
+      if (_pScans[i].iNumPeaks < 0
+            || _pScans[i].lFirstPeak > _lNumPeaks
+            || (uint64_t)_pScans[i].iNumPeaks > _lNumPeaks - _pScans[i].lFirstPeak)
+      {
+         Unmap();
+         return false;
+      }
+   }
+
+   return true;
+}
+
+
+// Number parsing for ParseText.  Fields are whitespace separated as with the
+// sscanf("P\t%lf\t%d\t%d\t") it replaces; a field that fails to parse leaves the
+// value untouched and returns NULL.
+
+static const char *hk_skip_space(const char *p,
+                                 const char *pEnd)
+{
+   while (p < pEnd && (*p == ' ' || *p == '\t' || *p == '\r'))
+      p++;
+   return p;
+}
+
+
+static const char *hk_parse_int(const char *p,
+                                const char *pEnd,
+                                int *piValue)
+{
+   bool bNegative = false;
+   int iValue = 0;
+
+   p = hk_skip_space(p, pEnd);
+
+   if (p < pEnd && (*p == '-' || *p == '+'))
+      bNegative = (*p++ == '-');
+
+   if (p == pEnd || *p < '0' || *p > '9')
+      return NULL;
+
+   while (p < pEnd && *p >= '0' && *p <= '9')
+      iValue = iValue*10 + (*p++ - '0');
+
+   *piValue = (bNegative ? -iValue : iValue);
+
+   return p;
+}
+
+
+static const char *hk_parse_double(const char *p,
+                                   const char *pEnd,
+                                   double *pdValue)
+{
+   // exact powers of ten; mantissa/10^n is then correctly rounded, same as strtod
+   static const double pdPow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+      1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+   const char *pStart;
+   bool bNegative = false;
+   uint64_t lMantissa = 0;
+   int iDigits = 0;
+   int iFraction = 0;
+
+   p = hk_skip_space(p, pEnd);
+   pStart = p;
+
+   if (p < pEnd && (*p == '-' || *p == '+'))
+      bNegative = (*p++ == '-');
+
+   while (p < pEnd && *p >= '0' && *p <= '9')
+   {
+      lMantissa = lMantissa*10 + (*p++ - '0');
+      iDigits++;
+   }
+   if (p < pEnd && *p == '.')
+   {
+      p++;
+      while (p < pEnd && *p >= '0' && *p <= '9')
+      {
+         lMantissa = lMantissa*10 + (*p++ - '0');
+         iDigits++;
+         iFraction++;
+      }
+   }
+
+   if (iDigits == 0)
+      return NULL;
+
+   if ((p < pEnd && (*p == 'e' || *p == 'E')) || iDigits > 15)
+   {
+      // not a plain fixed point number; hand it to strtod
+      char szTmp[64];
+      char *pParsed;
+      int iLen = 0;
+
+      while (pStart+iLen < pEnd && iLen < (int)sizeof(szTmp)-1
+            && pStart[iLen] != ' ' && pStart[iLen] != '\t' && pStart[iLen] != '\r')
+      {
+         szTmp[iLen] = pStart[iLen];
+         iLen++;
+      }
+      szTmp[iLen] = '\0';
+
+      *pdValue = strtod(szTmp, &pParsed);
+      return pStart + (pParsed - szTmp);
+   }
+
+   *pdValue = (double)lMantissa / pdPow10[iFraction];
+   if (bNegative)
+      *pdValue = -*pdValue;
+
+   return p;
+}
+
+
+// Reads the whole .hk file in one go (mapped where possible) and splits lines with
+// memchr; the S and P lines are the only ones used.
+bool mango_HardklorFile::ParseText(const char *szHK)
+{
+   struct stat st;
+   const char *pBuf;
+   int fd;
+
+   if ((fd = open(szHK, O_RDONLY)) < 0)
+      return false;
+
+   if (fstat(fd, &st) != 0)
+   {
+      close(fd);
+      return false;
+   }
+
+   size_t lSize = st.st_size;
+
+   _vScans.clear();
+   _vPeaks.clear();
+
+   if (lSize > 0)
+   {
+#ifdef _WIN32
+      char *pRead = new char[lSize];
+      if (read(fd, pRead, lSize) != (int)lSize)
+      {
+         delete[] pRead;
+         close(fd);
+         return false;
+      }
+      pBuf = pRead;
+#else
+      void *pMap = mmap(NULL, lSize, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (pMap == MAP_FAILED)
+      {
+         close(fd);
+         return false;
+      }
+      madvise(pMap, lSize, MADV_SEQUENTIAL);
+      pBuf = (const char *)pMap;
+#endif
+
+      _vPeaks.reserve(lSize / 48);
+
+      const char *pEnd = pBuf + lSize;
+      const char *pLine = pBuf;
+
+      while (pLine < pEnd)
+      {
+         const char *pEOL = (const char *)memchr(pLine, '\n', pEnd - pLine);
+
+         if (pEOL == NULL)
+            pEOL = pEnd;
+
+         if (*pLine == 'S')
+         {
+            HardklorScan scan;
+
+            scan.iScanNumber = 0;
+            hk_parse_int(pLine+1, pEOL, &scan.iScanNumber);
+            scan.iNumPeaks = 0;
+            scan.lFirstPeak = _vPeaks.size();
+
+            _vScans.push_back(scan);
+         }
+         else if (*pLine == 'P' && !_vScans.empty())
+         {
+            HardklorPeak peak;
+            const char *p;
+
+            peak.dNeutralMass = 0.0;
+            peak.iCharge = 0;
+            peak.iIntensity = 0;
+
+            if ((p = hk_parse_double(pLine+1, pEOL, &peak.dNeutralMass)) != NULL
+                  && (p = hk_parse_int(p, pEOL, &peak.iCharge)) != NULL)
+            {
+               hk_parse_int(p, pEOL, &peak.iIntensity);
+            }
+
+            _vPeaks.push_back(peak);
+            _vScans.back().iNumPeaks++;
+         }
+
+         pLine = pEOL + 1;
+      }
+
+#ifdef _WIN32
+      delete[] pBuf;
+#else
+      munmap((void *)pBuf, lSize);
+#endif
+   }
+
+   close(fd);
+
+   _lNumScans = _vScans.size();
+   _lNumPeaks = _vPeaks.size();
+   _pScans = _vScans.empty() ? NULL : &_vScans[0];
+   _pPeaks = _vPeaks.empty() ? NULL : &_vPeaks[0];
+
+   return true;
+}
+
+
+// A cache that cannot be written is not an error; the next run just parses the text again.
+void mango_HardklorFile::WriteCache(const char *szCache,
+                                    uint64_t lSourceSize,
+                                    int64_t lSourceMtime)
+{
+   FILE *fp;
+   char szTmp[SIZE_FILE];
+   HardklorCacheHeader hdr;
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.szMagic, HK_CACHE_MAGIC, sizeof(HK_CACHE_MAGIC));
+   hdr.iVersion = HK_CACHE_VERSION;
+   hdr.lSourceSize = lSourceSize;
+   hdr.lSourceMtime = lSourceMtime;
+   hdr.lNumScans = _lNumScans;
+   hdr.lNumPeaks = _lNumPeaks;
+   hdr.lFileSize = sizeof(HardklorCacheHeader) + _lNumScans*sizeof(HardklorScan) + _lNumPeaks*sizeof(HardklorPeak);
+
+   // write to a temporary file and rename so a concurrent run never maps a partial cache
+   snprintf(szTmp, sizeof(szTmp), "%s.%d", szCache, (int)getpid());
+
+   if ((fp=fopen(szTmp, "wb")) == NULL)
+   {
+      printf("\n Warning - cannot write Hardklor cache %s\n", szTmp);
+      return;
+   }
+
+   bool bOK = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+   if (bOK && _lNumScans > 0)
+      bOK = (fwrite(_pScans, sizeof(HardklorScan), _lNumScans, fp) == _lNumScans);
+   if (bOK && _lNumPeaks > 0)
+      bOK = (fwrite(_pPeaks, sizeof(HardklorPeak), _lNumPeaks, fp) == _lNumPeaks);
+   if (fclose(fp) != 0)
+      bOK = false;
+
+   if (!bOK || rename(szTmp, szCache) != 0)
+   {
+      printf("\n Warning - cannot write Hardklor cache %s\n", szCache);
+      remove(szTmp);
+   }
+}
@@ -0,0 +1,107 @@
+/*
+   Copyright 2017 University of Washington                          3-clause BSD license
+
+   Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+   3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//  Reader for Hardklor .hk1/.hk2 results with a binary sidecar cache.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef _MANGOHARDKLOR_H_
+#define _MANGOHARDKLOR_H_
+
+#include "Common.h"
+#include <stdint.h>
+
+#define HK_CACHE_EXT     ".bin"
+#define HK_CACHE_MAGIC   "MANGOHK"
+#define HK_CACHE_VERSION 1
+
+// One deconvoluted peak; a Hardklor "P" line.
+struct HardklorPeak
+{
+   double dNeutralMass;
+   int iCharge;
+   int iIntensity;
+};
+
+// One scan; a Hardklor "S" line and the range of its peaks in the peak array.
+struct HardklorScan
+{
+   int iScanNumber;
+   int iNumPeaks;
+   uint64_t lFirstPeak;
+};
+
+// Binary sidecar layout:  header, scan array, peak array.
+struct HardklorCacheHeader
+{
+   char szMagic[8];
+   uint32_t iVersion;
+   uint32_t iReserved;
+   uint64_t lSourceSize;         // size of the .hk text file the cache was built from
+   int64_t lSourceMtime;         // and its modification time
+   uint64_t lNumScans;
+   uint64_t lNumPeaks;
+   uint64_t lFileSize;           // size of the sidecar itself; guards against truncation
+};
+
+// Hardklor results of one .hk file.  The text file is parsed once and written to a
+// binary sidecar (<file>.hk1.bin) which later runs map directly for as long as the
+// text file's size and modification time are unchanged.
+class mango_HardklorFile
+{
+public:
+   mango_HardklorFile();
+   ~mango_HardklorFile();
+
+   bool Load(const char *szHK,
+             bool bUseCache = true);
+
+   int GetNumScans()
+   {
+      return (int)_lNumScans;
+   }
+
+   const HardklorScan &GetScan(int iWhichScan)
+   {
+      return _pScans[iWhichScan];
+   }
+
+   const HardklorPeak *GetPeaks(const HardklorScan &scan)
+   {
+      return _pPeaks + scan.lFirstPeak;
+   }
+
+private:
+   bool MapCache(const char *szCache,
+                 uint64_t lSourceSize,
+                 int64_t lSourceMtime);
+   bool ParseText(const char *szHK);
+   void WriteCache(const char *szCache,
+                   uint64_t lSourceSize,
+                   int64_t lSourceMtime);
+   void Unmap();
+
+   const char *_pMapBase;
+   size_t _lMapSize;
+
+   const HardklorScan *_pScans;
+   const HardklorPeak *_pPeaks;
+   uint64_t _lNumScans;
+   uint64_t _lNumPeaks;
+
+   vector<HardklorScan> _vScans;   // backing store when parsed from the text file
+   vector<HardklorPeak> _vPeaks;
+};
+
+#endif // _MANGOHARDKLOR_H_
@@ -15,6 +15,7 @@
 #include "Common.h"
 #include "mango_Preprocess.h"
 #include "mango_DataInternal.h"
+#include "mango_FastXcorr.h"
 
 //std::vector<Query*>           g_pvQuery;
 //std::vector<InputFileInfo *>  g_pvInputFiles;
@@ -28,6 +29,14 @@ bool *mango_preprocess::pbMemoryPool;
 double **mango_preprocess::ppdTmpRawDataArr;
 double **mango_preprocess::ppdTmpFastXcorrDataArr;
 double **mango_preprocess::ppdTmpCorrelationDataArr;
+float **mango_preprocess::ppfTmpFastXcorrDataArr;
+float **mango_preprocess::ppfTmpRawDataArr;
+float **mango_preprocess::ppfTmpWindowDataArr;
+float **mango_preprocess::ppfTmpCorrelationDataArr;
+int *mango_preprocess::piTmpFloatDirtyExtentArr;
+int *mango_preprocess::piTmpDirtyExtentArr;
+int mango_preprocess::_iMaxNumThreads;
+std::mutex mango_preprocess::_poolMutex;
 
 mango_preprocess::mango_preprocess()
 {
@@ -44,9 +53,10 @@ void mango_preprocess::Reset()
     _bDoneProcessingAllSpectra = false;
 }
 
-void mango_preprocess::LoadAndPreprocessSpectra(Spectrum *mstSpectrum)
+void mango_preprocess::LoadAndPreprocessSpectra(Spectrum *mstSpectrum,
+                                                struct QueryContext &queryContext)
 {
-   g_massRange.iMaxFragmentCharge = 0;
+   queryContext.iScanNumber = mstSpectrum->getScanNumber();
 
    if (mstSpectrum->getScanNumber() != 0)   // should not be needed by quick sanity check to make sure scan is read
    {
@@ -79,132 +89,180 @@ void mango_preprocess::LoadAndPreprocessSpectra(Spectrum *mstSpectrum)
       {
          if (CheckActivationMethodFilter(mstSpectrum->getActivationMethod()))
          {
-            int i=0;
+            // Called concurrently by the search threads so grab a free set of temporary arrays.
+            int i = AcquireMemoryPoolEntry();
+
+            PreprocessSpectrum(*mstSpectrum, queryContext, i);
 
-            PreprocessSpectrum(*mstSpectrum,
-                  ppdTmpRawDataArr[i],
-                  ppdTmpFastXcorrDataArr[i],
-                  ppdTmpCorrelationDataArr[i]);
+            ReleaseMemoryPoolEntry(i);
          }
       }
    }
 }
 
 
+// Marks a free set of temporary arrays as in use and returns its index.  There is
+// one set per thread passed to AllocateMemory so one is always free.
+int mango_preprocess::AcquireMemoryPoolEntry()
+{
+   int i;
+
+   _poolMutex.lock();
+   for (i=0; i<_iMaxNumThreads; i++)
+   {
+      if (!pbMemoryPool[i])
+      {
+         pbMemoryPool[i] = true;
+         break;
+      }
+   }
+   _poolMutex.unlock();
+
+   if (i == _iMaxNumThreads)
+   {
+      printf(" Error - no free preprocessing memory pool entry (%d allocated)\n", _iMaxNumThreads);
+      exit(1);
+   }
+
+   return i;
+}
+
+
+void mango_preprocess::ReleaseMemoryPoolEntry(int iPoolEntry)
+{
+   _poolMutex.lock();
+   pbMemoryPool[iPoolEntry] = false;
+   _poolMutex.unlock();
+}
+
+
 bool mango_preprocess::DoneProcessingAllSpectra()
 {
    return _bDoneProcessingAllSpectra;
 }
 
 
+// Builds the sparse fast xcorr spectrum of pScoring using the temporary arrays of
+// memory pool entry iPoolEntry.  float_preprocessing selects double or float
+// intermediate arrays; with 2 the double result is kept to check scores against.
 bool mango_preprocess::Preprocess(struct Query *pScoring,
                                   Spectrum mstSpectrum,
-                                  double *pdTmpRawData,
-                                  double *pdTmpFastXcorrData,
-                                  double *pdTmpCorrelationData)
+                                  int iPoolEntry)
 {
-   int i;
-   int x;
-   int y;
-   struct PreprocessStruct pPre;
-
-   pPre.iHighestIon = 0;
-   pPre.dHighestIntensity = 0;
+   float *pfFastXcorrData = ppfTmpFastXcorrDataArr[iPoolEntry];
+   int iFloatPreprocessing = g_staticParams.options.iFloatPreprocessing;
 
-   //MH: Find appropriately sized array cushion based on user parameters. Fixes error found by Patrick Pedrioli for
-   // very wide mass tolerance searches (i.e. 500 Da).
-   double dCushion = 0.0;
-   if (g_staticParams.tolerances.iMassToleranceUnits == 0) // amu
+   if (iFloatPreprocessing != 1)
    {
-      dCushion = g_staticParams.tolerances.dTolerancePeptide;
-
-      if (g_staticParams.tolerances.iMassToleranceType == 1)  // precursor m/z tolerance
+      if (!MakeFastXcorrSpectrum(pScoring, mstSpectrum, ppdTmpRawDataArr[iPoolEntry], ppdTmpFastXcorrDataArr[iPoolEntry],
+               ppdTmpCorrelationDataArr[iPoolEntry], pfFastXcorrData, &piTmpDirtyExtentArr[iPoolEntry]))
       {
-        dCushion *= 8; //MH: hope +8 is large enough charge because g_staticParams.options.iEndCharge can be overridden.
+         return false;
       }
+
+      if (!MakeSparseFastXcorrData(pScoring, pfFastXcorrData, pScoring->pFastXcorrData))
+         return false;
    }
-   else if (g_staticParams.tolerances.iMassToleranceUnits == 1) // mmu
+
+   if (iFloatPreprocessing == 2)
    {
-      dCushion = g_staticParams.tolerances.dTolerancePeptide * 0.001;
+      pScoring->pCheckFastXcorrData.swap(pScoring->pFastXcorrData);
+      pScoring->ppfCheckFastXcorrData = pScoring->pCheckFastXcorrData->ppfSparseFastXcorrData;
+      pScoring->_spectrumInfoInternal.dTotalIntensity = 0.0;   // summed again below
+   }
 
-      if (g_staticParams.tolerances.iMassToleranceType == 1)  // precursor m/z tolerance
+   if (iFloatPreprocessing != 0)
+   {
+      if (!MakeFastXcorrSpectrum(pScoring, mstSpectrum, ppfTmpRawDataArr[iPoolEntry], ppfTmpWindowDataArr[iPoolEntry],
+               ppfTmpCorrelationDataArr[iPoolEntry], pfFastXcorrData, &piTmpFloatDirtyExtentArr[iPoolEntry]))
       {
-         dCushion *= 8; //MH: hope +8 is large enough charge because g_staticParams.options.iEndCharge can be overridden.
+         return false;
       }
-   }
-   else // ppm
-   {
-      dCushion = g_staticParams.tolerances.dTolerancePeptide * g_staticParams.options.dPeptideMassHigh / 1000000.0;
+
+      if (!MakeSparseFastXcorrData(pScoring, pfFastXcorrData, pScoring->pFastXcorrData))
+         return false;
    }
 
-   // initialize these temporary arrays before re-using
-   size_t iTmp = (size_t)((g_staticParams.options.dPeptideMassHigh + dCushion + 2.0) * g_staticParams.dInverseBinWidth)*sizeof(double);
+   pScoring->iFastXcorrData = pScoring->pFastXcorrData->iFastXcorrData;
+   pScoring->ppfSparseFastXcorrData = pScoring->pFastXcorrData->ppfSparseFastXcorrData;
+
+   return true;
+}
 
-   memset(pdTmpRawData, 0, iTmp);
-   memset(pdTmpFastXcorrData, 0, iTmp);
-   memset(pdTmpCorrelationData, 0, iTmp);
 
-   // pdTmpRawData is a binned array holding raw data
-   if (!LoadIons(pScoring, pdTmpRawData, mstSpectrum, &pPre))
+// Bins, windows and fast xcorr transforms the spectrum into pfFastXcorrData; T is
+// the precision of the intermediate arrays.
+template <typename T>
+bool mango_preprocess::MakeFastXcorrSpectrum(struct Query *pScoring,
+                                             Spectrum &mstSpectrum,
+                                             T *pTmpRawData,
+                                             T *pTmpFastXcorrData,
+                                             T *pTmpCorrelationData,
+                                             float *pfFastXcorrData,
+                                             int *piDirtyExtent)
+{
+   struct PreprocessStruct pPre;
+
+   pPre.iHighestIon = 0;
+   pPre.dHighestIntensity = 0;
+
+   // Only the first *piDirtyExtent bins of the raw and correlation arrays can hold
+   // data from the previous spectrum so clear just those.  pTmpFastXcorrData needs
+   // no clearing as every bin below iArraySize is written before it is read.
+   memset(pTmpRawData, 0, *piDirtyExtent * sizeof(T));
+   memset(pTmpCorrelationData, 0, *piDirtyExtent * sizeof(T));
+   *piDirtyExtent = pScoring->_spectrumInfoInternal.iArraySize;
+
+   // pTmpRawData is a binned array holding raw data
+   if (!LoadIons(pScoring, pTmpRawData, mstSpectrum, &pPre))
    {
       return false;
    }
 
-   float pfFastXcorrData[pScoring->_spectrumInfoInternal.iArraySize];
+   // LoadIons and MakeCorrData only write bins up to the highest ion
+   *piDirtyExtent = pPre.iHighestIon + 1;
+   if (*piDirtyExtent > pScoring->_spectrumInfoInternal.iArraySize)
+      *piDirtyExtent = pScoring->_spectrumInfoInternal.iArraySize;
 
    // Create data for correlation analysis.
-   // pdTmpRawData intensities are normalized to 100; pdTmpCorrelationData is windowed
-   MakeCorrData(pdTmpRawData, pdTmpCorrelationData, pScoring, &pPre);
+   // pTmpRawData intensities are normalized to 100; pTmpCorrelationData is windowed
+   MakeCorrData(pTmpRawData, pTmpCorrelationData, pScoring, &pPre);
 
    // Make fast xcorr spectrum.
-   double dSum=0.0;
-   int iTmpRange = 2*g_staticParams.iXcorrProcessingOffset + 1;
-   double dTmp = 1.0 / (double)(iTmpRange - 1);
-
-   dSum=0.0;
-   for (i=0; i<g_staticParams.iXcorrProcessingOffset; i++)
-      dSum += pdTmpCorrelationData[i];
-   for (i=g_staticParams.iXcorrProcessingOffset; i < pScoring->_spectrumInfoInternal.iArraySize + g_staticParams.iXcorrProcessingOffset; i++)
-   {
-      if (i<pScoring->_spectrumInfoInternal.iArraySize)
-         dSum += pdTmpCorrelationData[i];
-      if (i>=iTmpRange && i-iTmpRange < pScoring->_spectrumInfoInternal.iArraySize)
-         dSum -= pdTmpCorrelationData[i-iTmpRange];
-      if (i-g_staticParams.iXcorrProcessingOffset >=0 && i-g_staticParams.iXcorrProcessingOffset < pScoring->_spectrumInfoInternal.iArraySize)
-         pdTmpFastXcorrData[i-g_staticParams.iXcorrProcessingOffset] = (dSum - pdTmpCorrelationData[i-g_staticParams.iXcorrProcessingOffset])* dTmp;
-   }
+   mango_FastXcorr::MakeWindowedMean(pTmpCorrelationData, pTmpFastXcorrData,
+         pScoring->_spectrumInfoInternal.iArraySize, g_staticParams.iXcorrProcessingOffset, mango_FastXcorr::GetKernel());
 
-   pfFastXcorrData[0] = 0.0;
-   for (i=1; i<pScoring->_spectrumInfoInternal.iArraySize; i++)
-   {
-      double dTmp = pdTmpCorrelationData[i] - pdTmpFastXcorrData[i];
+   // Add flanking peaks if used
+   mango_FastXcorr::MakeFastXcorrData(pTmpCorrelationData, pTmpFastXcorrData, pfFastXcorrData,
+         pScoring->_spectrumInfoInternal.iArraySize, (g_staticParams.ionInformation.iTheoreticalFragmentIons == 0),
+         mango_FastXcorr::GetKernel());
 
-      pfFastXcorrData[i] = (float)dTmp;
+   return true;
+}
 
-      // Add flanking peaks if used
-      if (g_staticParams.ionInformation.iTheoreticalFragmentIons == 0)
-      {
-         int iTmp;
 
-         iTmp = i-1;
-         pfFastXcorrData[i] += (float) ((pdTmpCorrelationData[iTmp] - pdTmpFastXcorrData[iTmp])*0.5);
+bool mango_preprocess::MakeSparseFastXcorrData(struct Query *pScoring,
+                                               float *pfFastXcorrData,
+                                               std::shared_ptr<SparseFastXcorrData> &pFastXcorrData)
+{
+   int i;
+   int x;
+   int y;
 
-         iTmp = i+1;
-         if (iTmp < pScoring->_spectrumInfoInternal.iArraySize)
-            pfFastXcorrData[i] += (float) ((pdTmpCorrelationData[iTmp] - pdTmpFastXcorrData[iTmp])*0.5);
-      }
-   }
+   SparseFastXcorrData *pSparse = new SparseFastXcorrData();
+   pFastXcorrData.reset(pSparse);
 
-   pScoring->iFastXcorrData=pScoring->_spectrumInfoInternal.iArraySize/SPARSE_MATRIX_SIZE+1;
+   pSparse->iFastXcorrData=pScoring->_spectrumInfoInternal.iArraySize/SPARSE_MATRIX_SIZE+1;
 
    //MH: Fill sparse matrix
    try
    {
-      pScoring->ppfSparseFastXcorrData = new float*[pScoring->iFastXcorrData]();
+      pSparse->ppfSparseFastXcorrData = new float*[pSparse->iFastXcorrData]();
    }
    catch (std::bad_alloc& ba)
    {
-      fprintf(stderr, " Error - new(pScoring->ppfSparseFastXcorrData[%d]). bad_alloc: %s.\n", pScoring->iFastXcorrData, ba.what());
+      pSparse->iFastXcorrData = 0;
+      fprintf(stderr, " Error - new(pScoring->ppfSparseFastXcorrData[%d]). bad_alloc: %s.\n", pScoring->_spectrumInfoInternal.iArraySize/SPARSE_MATRIX_SIZE+1, ba.what());
       fprintf(stderr, " mango ran out of memory. Look into \"spectrum_batch_size\"\n");
       fprintf(stderr, " parameters to address mitigate memory use.\n");
       return false;
@@ -215,11 +273,11 @@ bool mango_preprocess::Preprocess(struct Query *pScoring,
       if (pfFastXcorrData[i]>FLOAT_ZERO || pfFastXcorrData[i]<-FLOAT_ZERO)
       {
          x=i/SPARSE_MATRIX_SIZE;
-         if (pScoring->ppfSparseFastXcorrData[x]==NULL)
+         if (pSparse->ppfSparseFastXcorrData[x]==NULL)
          {
             try
             {
-               pScoring->ppfSparseFastXcorrData[x] = new float[SPARSE_MATRIX_SIZE]();
+               pSparse->ppfSparseFastXcorrData[x] = new float[SPARSE_MATRIX_SIZE]();
             }
             catch (std::bad_alloc& ba)
             {
@@ -229,10 +287,10 @@ bool mango_preprocess::Preprocess(struct Query *pScoring,
                return false;
             }
             for (y=0; y<SPARSE_MATRIX_SIZE; y++)
-               pScoring->ppfSparseFastXcorrData[x][y]=0;
+               pSparse->ppfSparseFastXcorrData[x][y]=0;
          }
          y=i-(x*SPARSE_MATRIX_SIZE);
-         pScoring->ppfSparseFastXcorrData[x][y] = pfFastXcorrData[i];
+         pSparse->ppfSparseFastXcorrData[x][y] = pfFastXcorrData[i];
       }
    }
 
@@ -330,12 +388,13 @@ bool mango_preprocess::CheckExit(int iAnalysisType,
 
 
 bool mango_preprocess::PreprocessSpectrum(Spectrum &spec,
-                                         double *pdTmpRawData,
-                                         double *pdTmpFastXcorrData,
-                                         double *pdTmpCorrelationData)
+                                         struct QueryContext &queryContext,
+                                         int iPoolEntry)
 {
    int z;
    int zStop;
+   vector<Query *> vpQuery;      // one per charge state, in spectrum order
+   Query *pLargest = NULL;       // the query with the largest array
 
    int iScanNumber = spec.getScanNumber();
 
@@ -346,11 +405,12 @@ bool mango_preprocess::PreprocessSpectrum(Spectrum &spec,
    {
       int iPrecursorCharge = spec.atZ(z).z;  // I need this before iChargeState gets assigned.
       double dMass = spec.atZ(z).mh;
-      Query *pScoring = new Query();
 
       if (dMass >= g_staticParams.options.dPeptideMassHigh)
          continue;
 
+      Query *pScoring = new Query();
+
       pScoring->_pepMassInfo.dExpPepMass = dMass;
       pScoring->_spectrumInfoInternal.iChargeState = iPrecursorCharge;
       pScoring->_spectrumInfoInternal.dTotalIntensity = 0.0;
@@ -395,27 +455,55 @@ bool mango_preprocess::PreprocessSpectrum(Spectrum &spec,
       pScoring->_spectrumInfoInternal.iArraySize = (int)((dMass + dCushion + 2.0) * g_staticParams.dInverseBinWidth);
 
       // g_massRange.iMaxFragmentCharge is global maximum fragment ion charge across all spectra.
+      _poolMutex.lock();
       if (pScoring->_spectrumInfoInternal.iMaxFragCharge > g_massRange.iMaxFragmentCharge)
       {
          g_massRange.iMaxFragmentCharge = pScoring->_spectrumInfoInternal.iMaxFragCharge;
       }
+      _poolMutex.unlock();
 
       if (!AdjustMassTol(pScoring))
       {
+         delete pScoring;
+         for (z=0; z<(int)vpQuery.size(); z++)
+            delete vpQuery.at(z);
          return false;
       }
 
-      // Populate pdCorrelation data.
-      // NOTE: there must be a good way of doing this just once per spectrum instead
-      //       of repeating for each charge state.
-      if (!Preprocess(pScoring, spec, pdTmpRawData, pdTmpFastXcorrData, pdTmpCorrelationData))
+      if (pLargest == NULL || pScoring->_spectrumInfoInternal.iArraySize > pLargest->_spectrumInfoInternal.iArraySize)
+         pLargest = pScoring;
+
+      vpQuery.push_back(pScoring);
+   }
+
+   if (vpQuery.empty())
+      return true;
+
+   // Populate pdCorrelation data once, sized for the largest charge state, and
+   // share the resulting sparse fast xcorr spectrum with the other charge states.
+   // Each query keeps its own iArraySize which bounds its fragment ion lookups.
+   if (!Preprocess(pLargest, spec, iPoolEntry))
+   {
+      for (z=0; z<(int)vpQuery.size(); z++)
+         delete vpQuery.at(z);
+      return false;
+   }
+
+   for (z=0; z<(int)vpQuery.size(); z++)
+   {
+      Query *pScoring = vpQuery.at(z);
+
+      if (pScoring != pLargest)
       {
-         return false;
+         pScoring->_spectrumInfoInternal.dTotalIntensity = pLargest->_spectrumInfoInternal.dTotalIntensity;
+         pScoring->pFastXcorrData = pLargest->pFastXcorrData;
+         pScoring->iFastXcorrData = pLargest->iFastXcorrData;
+         pScoring->ppfSparseFastXcorrData = pLargest->ppfSparseFastXcorrData;
+         pScoring->pCheckFastXcorrData = pLargest->pCheckFastXcorrData;
+         pScoring->ppfCheckFastXcorrData = pLargest->ppfCheckFastXcorrData;
       }
 
-      g_pvQuery.push_back(pScoring);
-
-      //delete pScoring;  //Why does this this causes a segfault??
+      queryContext.vpQuery.push_back(pScoring);   // freed by the QueryContext once the scan is searched
    }
 
    return true;
@@ -561,9 +649,10 @@ bool mango_preprocess::AdjustMassTol(struct Query *pScoring)
 
 
 //  Reads MSMS data file as ASCII mass/intensity pairs.
+template <typename T>
 bool mango_preprocess::LoadIons(struct Query *pScoring,
-                               double *pdTmpRawData,
-                               Spectrum mstSpectrum,
+                               T *pdTmpRawData,
+                               Spectrum &mstSpectrum,
                                struct PreprocessStruct *pPre)
 {
    int  i;
@@ -610,7 +699,7 @@ bool mango_preprocess::LoadIons(struct Query *pScoring,
                        && dIon < g_staticParams.options.dReporterMass+3*PROTON_MASS+0.1))
                {
                   if (dIntensity > pdTmpRawData[iBinIon])
-                     pdTmpRawData[iBinIon] = dIntensity;
+                     pdTmpRawData[iBinIon] = (T)dIntensity;
 
                   if (pdTmpRawData[iBinIon] > pPre->dHighestIntensity)
                      pPre->dHighestIntensity = pdTmpRawData[iBinIon];
@@ -626,8 +715,9 @@ bool mango_preprocess::LoadIons(struct Query *pScoring,
 
 
 // pdTmpRawData now holds raw data, pdTmpCorrelationData is windowed data after this function
-void mango_preprocess::MakeCorrData(double *pdTmpRawData,
-                                   double *pdTmpCorrelationData,
+template <typename T>
+void mango_preprocess::MakeCorrData(T *pdTmpRawData,
+                                   T *pdTmpCorrelationData,
                                    struct Query *pScoring,
                                    struct PreprocessStruct *pPre)
 {
@@ -667,7 +757,7 @@ void mango_preprocess::MakeCorrData(double *pdTmpRawData,
             if (iBin < pScoring->_spectrumInfoInternal.iArraySize)
             {
                if (pdTmpRawData[iBin] > dTmp2)
-                  pdTmpCorrelationData[iBin] = pdTmpRawData[iBin]*dTmp1;
+                  pdTmpCorrelationData[iBin] = (T)(pdTmpRawData[iBin]*dTmp1);
             }
          }
       }
@@ -709,16 +799,26 @@ bool mango_preprocess::AllocateMemory(int maxNumThreads)
    //MH: Must be equal to largest possible array
    int iArraySize = (int)((g_staticParams.options.dPeptideMassHigh + dCushion + 2.0) * g_staticParams.dInverseBinWidth);
 
+   _iMaxNumThreads = maxNumThreads;
+   g_massRange.iMaxFragmentCharge = 0;
+
+   // float_preprocessing 1 needs only the single precision arrays
+   bool bDoublePreprocessing = (g_staticParams.options.iFloatPreprocessing != 1);
+
    //MH: Initally mark all arrays as available (i.e. false=not inuse).
    pbMemoryPool = new bool[maxNumThreads];
+   piTmpDirtyExtentArr = new int[maxNumThreads];
+   piTmpFloatDirtyExtentArr = new int[maxNumThreads];
    for (i=0; i<maxNumThreads; i++)
    {
       pbMemoryPool[i] = false;
+      piTmpDirtyExtentArr[i] = 0;   // arrays below start out zeroed
+      piTmpFloatDirtyExtentArr[i] = 0;
    }
 
    //MH: Allocate arrays
    ppdTmpRawDataArr = new double*[maxNumThreads]();
-   for (i=0; i<maxNumThreads; i++)
+   for (i=0; i<maxNumThreads && bDoublePreprocessing; i++)
    {
       try
       {
@@ -735,7 +835,7 @@ bool mango_preprocess::AllocateMemory(int maxNumThreads)
 
    //MH: Allocate arrays
    ppdTmpFastXcorrDataArr = new double*[maxNumThreads]();
-   for (i=0; i<maxNumThreads; i++)
+   for (i=0; i<maxNumThreads && bDoublePreprocessing; i++)
    {
       try
       {
@@ -752,7 +852,7 @@ bool mango_preprocess::AllocateMemory(int maxNumThreads)
 
    //MH: Allocate arrays
    ppdTmpCorrelationDataArr = new double*[maxNumThreads]();
-   for (i=0; i<maxNumThreads; i++)
+   for (i=0; i<maxNumThreads && bDoublePreprocessing; i++)
    {
       try
       {
@@ -767,6 +867,47 @@ bool mango_preprocess::AllocateMemory(int maxNumThreads)
       }
    }
 
+   // single precision versions of the three arrays above for float_preprocessing
+   ppfTmpRawDataArr = new float*[maxNumThreads]();
+   ppfTmpWindowDataArr = new float*[maxNumThreads]();
+   ppfTmpCorrelationDataArr = new float*[maxNumThreads]();
+   if (g_staticParams.options.iFloatPreprocessing != 0)
+   {
+      for (i=0; i<maxNumThreads; i++)
+      {
+         try
+         {
+            ppfTmpRawDataArr[i] = new float[iArraySize]();
+            ppfTmpWindowDataArr[i] = new float[iArraySize]();
+            ppfTmpCorrelationDataArr[i] = new float[iArraySize]();
+         }
+         catch (std::bad_alloc& ba)
+         {
+            fprintf(stderr,  " Error - new(pfTmpRawData[%d]). bad_alloc: %s.\n", iArraySize, ba.what());
+            fprintf(stderr, "Mango ran out of memory. Look into \"spectrum_batch_size\"\n");
+            fprintf(stderr, "parameters to address mitigate memory use.\n");
+            return false;
+         }
+      }
+   }
+
+   // fast xcorr spectrum before it is copied to the sparse matrix; was a stack array
+   ppfTmpFastXcorrDataArr = new float*[maxNumThreads]();
+   for (i=0; i<maxNumThreads; i++)
+   {
+      try
+      {
+         ppfTmpFastXcorrDataArr[i] = new float[iArraySize]();
+      }
+      catch (std::bad_alloc& ba)
+      {
+         fprintf(stderr,  " Error - new(pfTmpFastXcorrData[%d]). bad_alloc: %s.\n", iArraySize, ba.what());
+         fprintf(stderr, "Mango ran out of memory. Look into \"spectrum_batch_size\"\n");
+         fprintf(stderr, "parameters to address mitigate memory use.\n");
+         return false;
+      }
+   }
+
    return true;
 }
 
@@ -777,17 +918,27 @@ bool mango_preprocess::DeallocateMemory(int maxNumThreads)
    int i;
 
    delete[] pbMemoryPool;
+   delete[] piTmpDirtyExtentArr;
+   delete[] piTmpFloatDirtyExtentArr;
 
    for (i=0; i<maxNumThreads; i++)
    {
       delete[] ppdTmpRawDataArr[i];
       delete[] ppdTmpFastXcorrDataArr[i];
       delete[] ppdTmpCorrelationDataArr[i];
+      delete[] ppfTmpFastXcorrDataArr[i];
+      delete[] ppfTmpRawDataArr[i];
+      delete[] ppfTmpWindowDataArr[i];
+      delete[] ppfTmpCorrelationDataArr[i];
    }
 
    delete[] ppdTmpRawDataArr;
    delete[] ppdTmpFastXcorrDataArr;
    delete[] ppdTmpCorrelationDataArr;
+   delete[] ppfTmpFastXcorrDataArr;
+   delete[] ppfTmpRawDataArr;
+   delete[] ppfTmpWindowDataArr;
+   delete[] ppfTmpCorrelationDataArr;
 
    return true;
 }
@@ -15,6 +15,8 @@
 #ifndef _MANGOPREPROCESS_H_
 #define _MANGOPREPROCESS_H_
 
+struct SparseFastXcorrData;
+
 class mango_preprocess
 {
 public:
@@ -22,18 +24,20 @@ public:
    ~mango_preprocess();
 
    static void Reset();
-   static void LoadAndPreprocessSpectra(Spectrum *mstSpectrum);
+   static void LoadAndPreprocessSpectra(Spectrum *mstSpectrum,
+                                        struct QueryContext &queryContext);
    static bool DoneProcessingAllSpectra();
    static bool AllocateMemory(int maxNumThreads);
    static bool DeallocateMemory(int maxNumThreads);
+   static int AcquireMemoryPoolEntry();
+   static void ReleaseMemoryPoolEntry(int iPoolEntry);
 
 private:
 
    // Private static methods
    static bool PreprocessSpectrum(Spectrum &spec,
-                                  double *pdTmpRawData,
-                                  double *pdTmpFastXcorrData,
-                                  double *pdTmpCorrelationData);
+                                  struct QueryContext &queryContext,
+                                  int iPoolEntry);
    static bool CheckExistOutFile(int iCharge,
                                  int iScanNum);
    static bool AdjustMassTol(struct Query *pScoring);
@@ -46,15 +50,26 @@ private:
                          int iNumSpectraLoaded);
    static bool Preprocess(struct Query *pScoring,
                           Spectrum mstSpectrum,
-                          double *pdTmpRawData,
-                          double *pdTmpFastXcorrData,
-                          double *pdTmpCorrelationData);
+                          int iPoolEntry);
+   template <typename T>
+   static bool MakeFastXcorrSpectrum(struct Query *pScoring,
+                                     Spectrum &mstSpectrum,
+                                     T *pTmpRawData,
+                                     T *pTmpFastXcorrData,
+                                     T *pTmpCorrelationData,
+                                     float *pfFastXcorrData,
+                                     int *piDirtyExtent);
+   static bool MakeSparseFastXcorrData(struct Query *pScoring,
+                                       float *pfFastXcorrData,
+                                       std::shared_ptr<SparseFastXcorrData> &pFastXcorrData);
+   template <typename T>
    static bool LoadIons(struct Query *pScoring,
-                        double *pdTmpRawData,
-                        Spectrum mstSpectrum,
+                        T *pdTmpRawData,
+                        Spectrum &mstSpectrum,
                         struct PreprocessStruct *pPre);
-   static void MakeCorrData(double *pdTmpRawData,
-                            double *pdTmpCorrelationData,
+   template <typename T>
+   static void MakeCorrData(T *pdTmpRawData,
+                            T *pdTmpCorrelationData,
                             struct Query *pScoring,
                             struct PreprocessStruct *pPre);
    static bool IsValidInputType(int inputType);
@@ -68,6 +83,14 @@ private:
    static double **ppdTmpRawDataArr;          //MH: Number of arrays equals threads
    static double **ppdTmpFastXcorrDataArr;    //MH: Ditto
    static double **ppdTmpCorrelationDataArr;  //MH: Ditto
+   static float **ppfTmpFastXcorrDataArr;     // Ditto
+   static float **ppfTmpRawDataArr;           // single precision arrays for float_preprocessing
+   static float **ppfTmpWindowDataArr;        // Ditto
+   static float **ppfTmpCorrelationDataArr;   // Ditto
+   static int *piTmpDirtyExtentArr;           // leading bins of raw/correlation arrays that may be non-zero
+   static int *piTmpFloatDirtyExtentArr;      // Ditto for the single precision arrays
+   static int _iMaxNumThreads;                // number of entries in the memory pool
+   static std::mutex _poolMutex;              // guards pbMemoryPool and g_massRange
 };
 
 #endif // _MANGOPREPROCESS_H_
@@ -19,6 +19,9 @@
 #include "mango_Preprocess.h"
 #include "CometDecoys.h"
 
+double mango_Search::_dMaxCheckDeviation;
+std::mutex mango_Search::_checkMutex;
+
 // Generate data for both sp scoring (pfSpScoreData) and xcorr analysis (FastXcorr).
 mango_Search::mango_Search()
 {
@@ -28,7 +31,18 @@ mango_Search::~mango_Search()
 {
 }
 
-void insert_pep_pq(char *pepArray[], char *proArray[], float xcorrArray[], char *ins_pep, char *ins_pro, float ins_xcorr)
+static char *copy_pep_pq_string(const char *str)
+{
+   if (str == NULL)
+      return NULL;
+
+   char *copy = new char[strlen(str) + 1];
+   strcpy(copy, str);
+   return copy;
+}
+
+// Strings are copied only when they make it into the top list, so callers can pass views
+void insert_pep_pq(char *pepArray[], char *proArray[], float xcorrArray[], const char *ins_pep, const char *ins_pro, float ins_xcorr)
 {
    int i; 
 
@@ -47,10 +61,10 @@ void insert_pep_pq(char *pepArray[], char *proArray[], float xcorrArray[], char
       xcorrArray[NUMPEPTIDES - 1] = ins_xcorr;
 
       if (pepArray[NUMPEPTIDES - 1]) delete [] pepArray[NUMPEPTIDES - 1];
-      pepArray[NUMPEPTIDES - 1] = ins_pep;
+      pepArray[NUMPEPTIDES - 1] = copy_pep_pq_string(ins_pep);
 
       if (proArray[NUMPEPTIDES - 1]) delete [] proArray[NUMPEPTIDES - 1];
-      proArray[NUMPEPTIDES - 1] = ins_pro;
+      proArray[NUMPEPTIDES - 1] = copy_pep_pq_string(ins_pro);
    } else return;
 
    // shiffle
@@ -70,10 +84,28 @@ void insert_pep_pq(char *pepArray[], char *proArray[], float xcorrArray[], char
    }
 }
 
+void free_pep_pq(char *pepArray[], char *proArray[])
+{
+   for (int i = 0; i < NUMPEPTIDES; i++) {
+      if (pepArray[i]) delete [] pepArray[i];
+      if (proArray[i]) delete [] proArray[i];
+      pepArray[i] = proArray[i] = NULL;
+   }
+}
+
 #define HISTOGRAM_BIN_SIZE 0.1
 #define MAX_XCORR_VALUE 20
 #define NUM_BINS (int)(MAX_XCORR_VALUE/HISTOGRAM_BIN_SIZE + 1)
 
+inline double mango_clamp_xcorr(double value)
+{
+    if (value > MAX_XCORR_VALUE)
+       value = MAX_XCORR_VALUE;
+    else if (value < 0)
+       value = 0;
+    return value;
+}
+
 inline int mango_get_histogram_bin_num(float value)
 {
     if (value > MAX_XCORR_VALUE)
@@ -83,6 +115,68 @@ inline int mango_get_histogram_bin_num(float value)
     return value/HISTOGRAM_BIN_SIZE;
 }
 
+#define COMBINED_SUBBINS 10   // sub-bins per histogram bin when convolving score distributions
+
+// Histogram of xcorr1+xcorr2 over every pep1/pep2 candidate pair.  Rather than visiting
+// each pair the two score distributions are convolved.  Scores are counted in sub-bins
+// of HISTOGRAM_BIN_SIZE/COMBINED_SUBBINS and each pair of sub-bins is placed by the
+// midpoint of its summed range (split evenly when the midpoint is a bin edge), so a pair
+// only lands in a neighboring bin of its exact score when that score is within a
+// sub-bin of a bin edge.
+void mango_convolve_histograms(vector<double> &vdXcorr_pep1,
+                               vector<double> &vdXcorr_pep2,
+                               int hist_combined[])
+{
+   const double dSubBinSize = HISTOGRAM_BIN_SIZE / COMBINED_SUBBINS;
+   const int iNumSubBins = NUM_BINS * COMBINED_SUBBINS;
+   vector<int> viSubHist1(iNumSubBins, 0);
+   vector<int> viSubHist2(iNumSubBins, 0);
+   int iMaxSubBin1 = 0;
+   int iMaxSubBin2 = 0;
+
+   for (vector<double>::iterator x = vdXcorr_pep1.begin(); x != vdXcorr_pep1.end(); ++x)
+   {
+      int iSubBin = (int)(mango_clamp_xcorr(*x) / dSubBinSize);
+      viSubHist1[iSubBin]++;
+      if (iSubBin > iMaxSubBin1)
+         iMaxSubBin1 = iSubBin;
+   }
+
+   for (vector<double>::iterator y = vdXcorr_pep2.begin(); y != vdXcorr_pep2.end(); ++y)
+   {
+      int iSubBin = (int)(mango_clamp_xcorr(*y) / dSubBinSize);
+      viSubHist2[iSubBin]++;
+      if (iSubBin > iMaxSubBin2)
+         iMaxSubBin2 = iSubBin;
+   }
+
+   for (int x=0; x<=iMaxSubBin1; x++)
+   {
+      if (viSubHist1[x] == 0)
+         continue;
+
+      for (int y=0; y<=iMaxSubBin2; y++)
+      {
+         if (viSubHist2[y] == 0)
+            continue;
+
+         int iCount = viSubHist1[x] * viSubHist2[y];
+         int iMidSubBin = x + y + 1;    // midpoint of the summed range in sub-bin units
+         int iBin = iMidSubBin / COMBINED_SUBBINS;
+
+         if (iBin >= NUM_BINS - 1)
+            hist_combined[NUM_BINS - 1] += iCount;
+         else if (iMidSubBin % COMBINED_SUBBINS == 0)
+         {
+            hist_combined[iBin - 1] += iCount / 2;
+            hist_combined[iBin] += iCount - iCount / 2;
+         }
+         else
+            hist_combined[iBin] += iCount;
+      }
+   }
+}
+
 void mango_print_histogram(int hist_pep[])
 {
    for (int i = 0; i <NUM_BINS; i++)
@@ -98,7 +192,7 @@ bool mango_Search::CalculateEValue(int *hist_pep,
                                    double *dSlope,
                                    double *dIntercept,
                                    double dNeutralPepMass,
-                                   int iScanNumber)
+                                   Query *pQuery)
 {
    int iMaxCorr;
    int iStartCorr;
@@ -106,7 +200,7 @@ bool mango_Search::CalculateEValue(int *hist_pep,
 
    if (iMatchPepCount < DECOY_SIZE)
    {
-      if (!GenerateXcorrDecoys(dNeutralPepMass, iMatchPepCount, hist_pep, iScanNumber))
+      if (!GenerateXcorrDecoys(dNeutralPepMass, iMatchPepCount, hist_pep, pQuery))
       {
          return false;
       }
@@ -119,6 +213,41 @@ bool mango_Search::CalculateEValue(int *hist_pep,
 }
 
 
+// The histogram of a released peptide only depends on the scan and the peptide mass
+// (which sets the candidate mass window) so reuse a fit already made for this mass.
+bool mango_Search::CalculateEValue(vector<HistogramFit> &vFits,
+                                   int *hist_pep,
+                                   int iMatchPepCount,
+                                   double *dSlope,
+                                   double *dIntercept,
+                                   double dNeutralPepMass,
+                                   Query *pQuery)
+{
+   for (int i=0; i<(int)vFits.size(); i++)
+   {
+      // shared sides of a scan's precursor pairs carry the identical mass value
+      if (vFits.at(i).dNeutralPepMass == dNeutralPepMass && vFits.at(i).pQuery == pQuery)
+      {
+         *dSlope = vFits.at(i).dSlope;
+         *dIntercept = vFits.at(i).dIntercept;
+         return true;
+      }
+   }
+
+   if (!CalculateEValue(hist_pep, iMatchPepCount, dSlope, dIntercept, dNeutralPepMass, pQuery))
+      return false;
+
+   HistogramFit fit;
+   fit.dNeutralPepMass = dNeutralPepMass;
+   fit.pQuery = pQuery;
+   fit.dSlope = *dSlope;
+   fit.dIntercept = *dIntercept;
+   vFits.push_back(fit);
+
+   return true;
+}
+
+
 void mango_Search::LinearRegression(int *piHistogram,
                                      double *slope,
                                      double *intercept,
@@ -254,153 +383,162 @@ void mango_Search::LinearRegression(int *piHistogram,
 }
 
 
+// Fragment ion bins of the synthetic decoys in CometDecoys.h.  These depend only on the
+// fragment bin size and offset so are calculated once per run in InitializeDecoyBins().
+static int g_piDecoyBinsN[DECOY_SIZE][MAX_DECOY_PEP_LEN];
+static int g_piDecoyBinsC[DECOY_SIZE][MAX_DECOY_PEP_LEN];
+
+void mango_Search::InitializeDecoyBins()
+{
+   for (int i=0; i<DECOY_SIZE; i++)
+   {
+      for (int j=0; j<MAX_DECOY_PEP_LEN; j++)
+      {
+         g_piDecoyBinsN[i][j] = BIN(decoyIons[i].pdIonsN[j]);
+         g_piDecoyBinsC[i][j] = BIN(decoyIons[i].pdIonsC[j]);
+      }
+   }
+}
+
+
 // Make synthetic decoy spectra to fill out correlation histogram by going
 // through each candidate peptide and rotating spectra in m/z space.
 bool mango_Search::GenerateXcorrDecoys(double dNeutralPepMass,
                                         int iMatchPepCount,
                                         int *hist_pep,
-                                        int iScanNumber)
+                                        Query *pQuery)
 {
    int i;
-   int ii;
    int j;
    int bin_num;
-   int iMaxFragCharge;
-   int ctCharge;
-   double dBion;
-   double dYion;
    double dFastXcorr;
-   double dFragmentIonMass;
 
-   int *piHistogram;
+   if (pQuery == NULL)
+      return false;
 
-   int iFragmentIonMass;
-   int iWhichQuery;
+   int iArraySize = pQuery->_spectrumInfoInternal.iArraySize;
+   float **ppfSparseFastXcorrData = pQuery->ppfSparseFastXcorrData;
 
-   for (iWhichQuery=0; iWhichQuery<(int)g_pvQuery.size(); iWhichQuery++)
-   {
-      if (g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iScanNumber == iScanNumber)
-         break;
-   }
-   if (iWhichQuery < (int)g_pvQuery.size() && g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iScanNumber == iScanNumber)
-   {
-      Query* pQuery = g_pvQuery.at(iWhichQuery);
-
-      piHistogram = hist_pep;
+   // DECOY_SIZE is the minimum # of decoys required or else this function is
+   // called.  So need generate iLoopMax more xcorr scores for the histogram.
+   int iLoopMax = DECOY_SIZE - iMatchPepCount;
 
-      //iMaxFragCharge = pQuery->_spectrumInfoInternal.iMaxFragCharge;
-      iMaxFragCharge = 1;  //FIX only considering 1+ charges now
-
-      // DECOY_SIZE is the minimum # of decoys required or else this function is
-      // called.  So need generate iLoopMax more xcorr scores for the histogram.
-      int iLoopMax = DECOY_SIZE - iMatchPepCount;
-      int iLastEntry;
-
-      iLastEntry = iMatchPepCount;
-
-      if (iLastEntry > g_staticParams.options.iNumStored)
-         iLastEntry = g_staticParams.options.iNumStored;
+   // Only 1+ fragment ions are considered so the pre-binned decoy ions are
+   // simply gathered from the sparse fast xcorr array.
+   for (i=0; i<iLoopMax; i++)  // iterate through required # decoys
+   {
+      dFastXcorr = 0.0;
 
-      j=0;
-      for (i=0; i<iLoopMax; i++)  // iterate through required # decoys
+      for (j=0; j<MAX_DECOY_PEP_LEN; j++)  // iterate through decoy fragment ions
       {
-         dFastXcorr = 0.0;
+         int piBins[2] = {g_piDecoyBinsN[i][j], g_piDecoyBinsC[i][j]};
+         double pdMasses[2] = {decoyIons[i].pdIonsN[j], decoyIons[i].pdIonsC[j]};
 
-         for (j=0; j<MAX_DECOY_PEP_LEN; j++)  // iterate through decoy fragment ions
+         for (int ii=0; ii<2; ii++)
          {
-            dBion = decoyIons[i].pdIonsN[j];
-            dYion = decoyIons[i].pdIonsC[j];
-
-            for (ii=0; ii<2; ii++)
+            if (pdMasses[ii] < dNeutralPepMass)
             {
-               dFragmentIonMass =  0.0;
-               switch (ii)
-               {
-                  case 0:
-                     dFragmentIonMass = dBion;
-                     break;
-                  case 1:
-                     dFragmentIonMass = dYion;
-                     break;
-               }
+               int iFragmentIonMass = piBins[ii];
 
-               for (ctCharge=1; ctCharge<=iMaxFragCharge; ctCharge++)
+               if (iFragmentIonMass < iArraySize && iFragmentIonMass >= 0)
                {
-                  dFragmentIonMass = (dFragmentIonMass + (ctCharge-1)*PROTON_MASS)/ctCharge;
-
-                  if (dFragmentIonMass < dNeutralPepMass)
+                  int x = iFragmentIonMass / SPARSE_MATRIX_SIZE;
+                  if (ppfSparseFastXcorrData[x]!=NULL)
                   {
-                     iFragmentIonMass = BIN(dFragmentIonMass);
-
-                     if (iFragmentIonMass < pQuery->_spectrumInfoInternal.iArraySize && iFragmentIonMass >= 0)
-                     {
-                        int x = iFragmentIonMass / SPARSE_MATRIX_SIZE;
-                        if (pQuery->ppfSparseFastXcorrData[x]!=NULL)
-                        {
-                           int y = iFragmentIonMass - (x*SPARSE_MATRIX_SIZE);
-                           dFastXcorr += pQuery->ppfSparseFastXcorrData[x][y];
-                        }
-                     }
-                     else
-                     {
-                        char szErrorMsg[256];
-                        sprintf(szErrorMsg,  " Error - XCORR DECOY: dFragMass %f, iFragMass %d, ArraySize %d, InputMass %f, scan %d, z %d",
-                              dFragmentIonMass,
-                              iFragmentIonMass,
-                              pQuery->_spectrumInfoInternal.iArraySize,
-                              pQuery->_pepMassInfo.dExpPepMass,
-                              pQuery->_spectrumInfoInternal.iScanNumber,
-                              ctCharge);
-
-                        string strErrorMsg(szErrorMsg);
-                        logerr(szErrorMsg);
-                        return false;
-                     }
+                     int y = iFragmentIonMass - (x*SPARSE_MATRIX_SIZE);
+                     dFastXcorr += ppfSparseFastXcorrData[x][y];
                   }
-
+               }
+               else
+               {
+                  char szErrorMsg[256];
+                  sprintf(szErrorMsg,  " Error - XCORR DECOY: dFragMass %f, iFragMass %d, ArraySize %d, InputMass %f, scan %d, z %d",
+                        pdMasses[ii],
+                        iFragmentIonMass,
+                        iArraySize,
+                        pQuery->_pepMassInfo.dExpPepMass,
+                        pQuery->_spectrumInfoInternal.iScanNumber,
+                        1);
+
+                  logerr(szErrorMsg);
+                  return false;
                }
             }
          }
-
-         dFastXcorr *= 0.005;
-         bin_num = mango_get_histogram_bin_num(dFastXcorr);
-         piHistogram[bin_num] += 1;
       }
 
-      return true;
+      dFastXcorr *= 0.005;
+      bin_num = mango_get_histogram_bin_num(dFastXcorr);
+      hist_pep[bin_num] += 1;
    }
 
-   return false;
+   return true;
+}
 
+
+// printf-style append; each scan's output is buffered so it can be written in scan order
+static void mango_append(string &str, const char *szFormat, ...)
+{
+   char szBuf[1024];
+   va_list args;
+
+   va_start(args, szFormat);
+   int iLen = vsnprintf(szBuf, sizeof(szBuf), szFormat, args);
+   va_end(args);
+
+   if (iLen < 0)
+      return;
+
+   if (iLen < (int)sizeof(szBuf))
+   {
+      str.append(szBuf, iLen);
+      return;
+   }
+
+   vector<char> vBuf(iLen + 1);
+   va_start(args, szFormat);
+   vsnprintf(&vBuf[0], vBuf.size(), szFormat, args);
+   va_end(args);
+   str.append(&vBuf[0], iLen);
 }
 
 
+// State shared by the reader and search threads.  A single reader thread decodes
+// the spectra that have precursor pairs (MSReader is not thread safe) into a
+// bounded queue; the search threads preprocess and score them concurrently and
+// each scan's output is handed back to SearchForPeptides to be written in scan order.
+struct SearchThreadData
+{
+   MSReader *pReader;
+   protein_hash_db_t phdp;
+   char *szBaseName;
+
+   vector<Spectrum *> vpQueue;          // ring buffer of decoded spectra
+   vector<int> viQueueScan;             // pvSpectrumList entry of each queued spectrum
+   int iQueueHead;                      // next slot to search
+   int iQueueCount;                     // number of filled slots
+   bool bReadDone;                      // set once the reader has queued its last spectrum
+   std::mutex queueMutex;               // guards the queue and bReadDone
+   std::condition_variable queueNotEmpty;
+   std::condition_variable queueNotFull;
+
+   vector<string> vstrTxt;              // buffered txt output of each scan
+   vector<string> vstrXml;              // buffered pepXML output of each scan
+   vector<char> vbDone;                 // set once a scan's output is buffered
+   std::mutex outputMutex;              // guards vstrTxt, vstrXml and vbDone
+   std::condition_variable outputCond;
+};
+
+
 void mango_Search::SearchForPeptides(char *szMZXML,
                                      const char *protein_file,
-                                     enzyme_cut_params params,
-                                     const char *pep_hash_file)
+                                     protein_hash_db_t phdp)
 {
    int i;
    int ii;
-   int hist_pep1[NUM_BINS],
-       hist_pep2[NUM_BINS],
-       hist_combined[NUM_BINS],
-       num_pep1,
-       num_pep2,
-       num_pep_combined;
 
    char szOutputTxt[SIZE_FILE];
 
-   char *toppep1[NUMPEPTIDES], *toppep2[NUMPEPTIDES], *toppepcombined[NUMPEPTIDES];
-   char *toppro1[NUMPEPTIDES], *toppro2[NUMPEPTIDES], *topprocombined[NUMPEPTIDES];
-   float xcorrPep1[NUMPEPTIDES], xcorrPep2[NUMPEPTIDES], xcorrCombined[NUMPEPTIDES];
-
-   for (ii = 0; ii < NUMPEPTIDES; ii++)
-   {
-      toppep1[ii] = toppep2[ii] = toppepcombined[ii] = NULL;
-      toppro1[ii] = toppro2[ii] = topprocombined[ii] = NULL;
-   }
-
    strcpy(szOutputTxt, szMZXML);
    szOutputTxt[strlen(szOutputTxt)-5]='\0';
    strcat(szOutputTxt, "txt");
@@ -420,16 +558,10 @@ void mango_Search::SearchForPeptides(char *szMZXML,
    mstReader.setFilter(msLevel);
    mstReader.readFile(szMZXML, mstSpectrum, 1);
  
-   mango_preprocess::AllocateMemory(1);
-
-   // If PeptideHash not present, generate it now; otherwise open the hash file.
-   protein_hash_db_t phdp = phd_retrieve_hash_db(protein_file, params, pep_hash_file);
-
    fprintf(fptxt, "scan\texp_mass1\texp_mass2\tpeptide1\txcorr1\tevalue1\tcalcmass1\tpeptide2\txcorr2\tevalue2\tcalcmass2\tcombinedxcorr\tcombinedevalue\n"); 
    FILE *fpxml;
    char szOutput[1024];
    char szBaseName[1024];
-   char *combinedPep;
 
    strcpy(szBaseName, szMZXML);
    if (!strcmp(szBaseName+strlen(szBaseName)-6, ".mzXML"))
@@ -475,7 +607,6 @@ void mango_Search::SearchForPeptides(char *szMZXML,
       printf(" Error - cannot write pepXML output %s\n", szOutput);
       return;
    }
-   int iIndex=0;
 
    WritePepXMLHeader(fpxml, szBaseName, protein_file, g_staticParams.options.iMimicCometPepXML);
 
@@ -487,187 +618,370 @@ void mango_Search::SearchForPeptides(char *szMZXML,
 
 // g_staticParams.options.bVerboseOutput = true;
 
+   int iNumThreads = g_staticParams.options.iNumThreads;
+   if (iNumThreads <= 0)
+      iNumThreads = (int)std::thread::hardware_concurrency();
+   if (iNumThreads > MAX_THREADS)
+      iNumThreads = MAX_THREADS;
+   if (iNumThreads > (int)pvSpectrumList.size())
+      iNumThreads = (int)pvSpectrumList.size();
+   if (iNumThreads < 1 || g_staticParams.options.bVerboseOutput)  // keep verbose output of a scan together
+      iNumThreads = 1;
+
+   mango_preprocess::AllocateMemory(iNumThreads);
+
+   _dMaxCheckDeviation = 0.0;
+
+   SearchThreadData searchData;
+   searchData.pReader = &mstReader;
+   searchData.phdp = phdp;
+   searchData.szBaseName = szBaseName;
+   searchData.vpQueue.assign(PREFETCH_SCANS_PER_THREAD * iNumThreads, NULL);
+   searchData.viQueueScan.assign(PREFETCH_SCANS_PER_THREAD * iNumThreads, 0);
+   searchData.iQueueHead = 0;
+   searchData.iQueueCount = 0;
+   searchData.bReadDone = false;
+   searchData.vstrTxt.resize(pvSpectrumList.size());
+   searchData.vstrXml.resize(pvSpectrumList.size());
+   searchData.vbDone.assign(pvSpectrumList.size(), 0);
+
+   std::thread readerThread(ReaderThreadProc, &searchData);
+
+   vector<std::thread> vThreads;
+   for (i=0; i<iNumThreads; i++)
+      vThreads.push_back(std::thread(SearchThreadProc, &searchData));
+
+   // Write out each scan's results in scan order as they become available.
    for (i=0; i<(int)pvSpectrumList.size(); i++)
    {
+      string strTxt;
+      string strXml;
 
-// if (1) //pvSpectrumList.at(i).iScanNumber >=18858 && pvSpectrumList.at(i).iScanNumber<=18858) // limit analysis range during dev/testing
-// {
+      {
+         std::unique_lock<std::mutex> lock(searchData.outputMutex);
+         searchData.outputCond.wait(lock, [&searchData, i] { return searchData.vbDone[i] != 0; });
+         strTxt.swap(searchData.vstrTxt[i]);
+         strXml.swap(searchData.vstrXml[i]);
+      }
 
-      Spectrum mstSpectrum;           // For holding spectrum.
+      fputs(strTxt.c_str(), fptxt);
+      fputs(strXml.c_str(), fpxml);
 
-      // Loads in MSMS spectrum data.
-      mstReader.readFile(NULL, mstSpectrum, pvSpectrumList.at(i).iScanNumber);
+      if (!g_staticParams.options.bVerboseOutput)
+      {
+         printf("%5.1f%%", (float)(100.0*i/pvSpectrumList.size()));
+         fflush(stdout);
+         printf("\b\b\b\b\b\b");
+      }
+   }
+
+   readerThread.join();
+   for (i=0; i<iNumThreads; i++)
+      vThreads.at(i).join();
+
+   mango_preprocess::DeallocateMemory(iNumThreads);
+
+   if (g_staticParams.options.iFloatPreprocessing == 2)
+      printf(" float preprocessing: max xcorr deviation from double path %0.6f\n", _dMaxCheckDeviation);
+
+   fprintf(fpxml, "  </msms_run_summary>\n");
+   fprintf(fpxml, "</msms_pipeline_analysis>\n");
+
+   fclose(fptxt);
+   fclose(fpxml);
+}
 
-      // should be able to thread here; passing mstSpectrum to each thread.
 
-      mango_preprocess::LoadAndPreprocessSpectra(&mstSpectrum);
+// Decodes the spectra with precursor pairs ahead of the search threads.  Scans
+// without pairs produce no output and are marked done without being read.
+void mango_Search::ReaderThreadProc(SearchThreadData *pData)
+{
+   int iQueueSize = (int)pData->vpQueue.size();
 
-      for (ii=0; ii<(int)pvSpectrumList.at(i).pvdPrecursors.size(); ii++)
+   for (int iWhichScan=0; iWhichScan<(int)pvSpectrumList.size(); iWhichScan++)
+   {
+      if (pvSpectrumList.at(iWhichScan).pvdPrecursors.empty())
       {
-         for (int j = 0; j < NUM_BINS; j++)
-            hist_pep1[j] = hist_pep2[j] = hist_combined[j] = 0;
+         pData->outputMutex.lock();
+         pData->vbDone.at(iWhichScan) = 1;
+         pData->outputMutex.unlock();
+         pData->outputCond.notify_one();
+         continue;
+      }
 
-         num_pep1 = num_pep2 = num_pep_combined = 0;
+      Spectrum *pSpectrum = new Spectrum;
+      pData->pReader->readFile(NULL, *pSpectrum, pvSpectrumList.at(iWhichScan).iScanNumber);
 
-         double dMZ1 =  (pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1
-               + pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge1 * PROTON_MASS)/ pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge1;
-         double dMZ2 =  (pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2
-               + pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge2 * PROTON_MASS)/ pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge2;
+      std::unique_lock<std::mutex> lock(pData->queueMutex);
+      pData->queueNotFull.wait(lock, [pData, iQueueSize] { return pData->iQueueCount < iQueueSize; });
 
-         for (int li = 0; li < NUMPEPTIDES; li++)
-         {
-            xcorrPep1[li] = xcorrPep2[li] = xcorrCombined[li] = -99999;
-            toppep1[li] = toppep2[li] = toppepcombined[li] = NULL;
-         }
+      int iSlot = (pData->iQueueHead + pData->iQueueCount) % iQueueSize;
+      pData->vpQueue[iSlot] = pSpectrum;
+      pData->viQueueScan[iSlot] = iWhichScan;
+      pData->iQueueCount++;
 
-         if (g_staticParams.options.bVerboseOutput)
-         {
-            printf("Scan %d (i=%d), retrieving peptides of mass %0.4f (%d+ %0.4f) and %0.4f (%d+ %0.4f)\n",
-                  pvSpectrumList.at(i).iScanNumber,
-                  i,
-                  pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1,
-                  pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge1,
-                  dMZ1,
-                  pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2,
-                  pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge2,
-                  dMZ2);
-         }
+      lock.unlock();
+      pData->queueNotEmpty.notify_one();
+   }
+
+   pData->queueMutex.lock();
+   pData->bReadDone = true;
+   pData->queueMutex.unlock();
+   pData->queueNotEmpty.notify_all();
+}
 
-         double pep_mass1 = pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1 - g_staticParams.options.dLysineStumpMass - g_staticParams.precalcMasses.dOH2;
-         double pep_mass2 = pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2 - g_staticParams.options.dLysineStumpMass - g_staticParams.precalcMasses.dOH2;
 
-         if (pep_mass1 <= 0)
-         {
-            cout << "Peptide mass1 is coming out to be zero after removing Lysine residue" << endl;
-            exit(1);
-         }
+void mango_Search::SearchThreadProc(SearchThreadData *pData)
+{
+   vector<phd_peptide_view> vPeptides;   // candidate buffer reused by every ScorePeptides call
+   int iQueueSize = (int)pData->vpQueue.size();
 
-         if (pep_mass2 <= 0)
-         {
-            cout << "Peptide mass2 is coming out to be zero after removing Lysine residue" << endl;
-            exit(1);
-         }
+   while (true)
+   {
+      Spectrum *pSpectrum;
+      int iWhichScan;
 
-         vector<double> vdXcorr_pep1;  // store xcorr scores to be used in combined histogram
-         vector<double> vdXcorr_pep2;
+      {
+         std::unique_lock<std::mutex> lock(pData->queueMutex);
+         pData->queueNotEmpty.wait(lock, [pData] { return pData->iQueueCount > 0 || pData->bReadDone; });
 
-         if (g_staticParams.options.bVerboseOutput)
-         {
-            cout << "After Lysine residue reduction the peptide of mass " << pep_mass1 << " are being extracted";
-            cout << " (" << pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1 << ")" << endl;
-         }
+         if (pData->iQueueCount == 0)
+            break;
+
+         pSpectrum = pData->vpQueue[pData->iQueueHead];
+         iWhichScan = pData->viQueueScan[pData->iQueueHead];
+         pData->iQueueHead = (pData->iQueueHead + 1) % iQueueSize;
+         pData->iQueueCount--;
+      }
+      pData->queueNotFull.notify_one();
+
+      string strTxt;
+      string strXml;
+
+      SearchScan(iWhichScan, *pSpectrum, pData->phdp, pData->szBaseName, vPeptides, strTxt, strXml);
+
+      delete pSpectrum;
+
+      pData->outputMutex.lock();
+      pData->vstrTxt.at(iWhichScan).swap(strTxt);
+      pData->vstrXml.at(iWhichScan).swap(strXml);
+      pData->vbDone.at(iWhichScan) = 1;
+      pData->outputMutex.unlock();
+      pData->outputCond.notify_one();
+   }
+}
+
+
+// Preprocess and score all precursor pairs of one spectrum; output is appended to strTxt and strXml.
+void mango_Search::SearchScan(int i,
+                              Spectrum &mstSpectrum,
+                              protein_hash_db_t phdp,
+                              char *szBaseName,
+                              vector<phd_peptide_view> &vPeptides,
+                              string &strTxt,
+                              string &strXml)
+{
+   int ii;
+   int hist_pep1[NUM_BINS],
+       hist_pep2[NUM_BINS],
+       hist_combined[NUM_BINS],
+       num_pep1,
+       num_pep2,
+       num_pep_combined;
+
+   char *toppep1[NUMPEPTIDES], *toppep2[NUMPEPTIDES], *toppepcombined[NUMPEPTIDES];
+   char *toppro1[NUMPEPTIDES], *toppro2[NUMPEPTIDES], *topprocombined[NUMPEPTIDES];
+   float xcorrPep1[NUMPEPTIDES], xcorrPep2[NUMPEPTIDES], xcorrCombined[NUMPEPTIDES];
+   char *combinedPep;
+   int iIndex=0;
+   vector<HistogramFit> vFits;   // pep1/pep2 fits of this scan
+
+   for (ii = 0; ii < NUMPEPTIDES; ii++)
+   {
+      toppep1[ii] = toppep2[ii] = toppepcombined[ii] = NULL;
+      toppro1[ii] = toppro2[ii] = topprocombined[ii] = NULL;
+   }
+
+   QueryContext queryContext;
+
+   mango_preprocess::LoadAndPreprocessSpectra(&mstSpectrum, queryContext);
+
+   // nothing to score if the spectrum did not pass the preprocessing filters
+   if (queryContext.vpQuery.empty())
+      return;
+
+   for (ii=0; ii<(int)pvSpectrumList.at(i).pvdPrecursors.size(); ii++)
+   {
+      for (int j = 0; j < NUM_BINS; j++)
+         hist_pep1[j] = hist_pep2[j] = hist_combined[j] = 0;
+
+      num_pep1 = num_pep2 = num_pep_combined = 0;
+
+      double dMZ1 =  (pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1
+            + pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge1 * PROTON_MASS)/ pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge1;
+      double dMZ2 =  (pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2
+            + pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge2 * PROTON_MASS)/ pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge2;
+
+      free_pep_pq(toppep1, toppro1);
+      free_pep_pq(toppep2, toppro2);
+      free_pep_pq(toppepcombined, topprocombined);
+      for (int li = 0; li < NUMPEPTIDES; li++)
+         xcorrPep1[li] = xcorrPep2[li] = xcorrCombined[li] = -99999;
+
+      if (g_staticParams.options.bVerboseOutput)
+      {
+         printf("Scan %d (i=%d), retrieving peptides of mass %0.4f (%d+ %0.4f) and %0.4f (%d+ %0.4f)\n",
+               pvSpectrumList.at(i).iScanNumber,
+               i,
+               pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1,
+               pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge1,
+               dMZ1,
+               pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2,
+               pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge2,
+               dMZ2);
+      }
+
+      double pep_mass1 = pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1 - g_staticParams.options.dLysineStumpMass - g_staticParams.precalcMasses.dOH2;
+      double pep_mass2 = pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2 - g_staticParams.options.dLysineStumpMass - g_staticParams.precalcMasses.dOH2;
+
+      if (pep_mass1 <= 0)
+      {
+         cout << "Peptide mass1 is coming out to be zero after removing Lysine residue" << endl;
+         exit(1);
+      }
+
+      if (pep_mass2 <= 0)
+      {
+         cout << "Peptide mass2 is coming out to be zero after removing Lysine residue" << endl;
+         exit(1);
+      }
+
+      // query of the charge state whose arrays cover each released peptide
+      Query *pQuery1 = queryContext.GetQuery(pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1);
+      Query *pQuery2 = queryContext.GetQuery(pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2);
+
+      vector<double> vdXcorr_pep1;  // store xcorr scores to be used in combined histogram
+      vector<double> vdXcorr_pep2;
+
+      if (g_staticParams.options.bVerboseOutput)
+      {
+         cout << "After Lysine residue reduction the peptide of mass " << pep_mass1 << " are being extracted";
+         cout << " (" << pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1 << ")" << endl;
+      }
   
-         ScorePeptides(phdp, pep_mass1, toppep1, toppro1, xcorrPep1, vdXcorr_pep1, hist_pep1, &num_pep1, pvSpectrumList.at(i).iScanNumber);
+      ScorePeptides(phdp, pep_mass1, toppep1, toppro1, xcorrPep1, vdXcorr_pep1, hist_pep1, &num_pep1, pQuery1, vPeptides);
 
-         if (g_staticParams.options.bVerboseOutput)
-         {
-            cout << "After Lysine residue reduction the peptide of mass " << pep_mass2 << " are being extracted";
-            cout << " (" << pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2 << ")" << endl;
-         }
+      if (g_staticParams.options.bVerboseOutput)
+      {
+         cout << "After Lysine residue reduction the peptide of mass " << pep_mass2 << " are being extracted";
+         cout << " (" << pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2 << ")" << endl;
+      }
 
-         ScorePeptides(phdp, pep_mass2, toppep2, toppro2, xcorrPep2, vdXcorr_pep2, hist_pep2, &num_pep2, pvSpectrumList.at(i).iScanNumber);
+      ScorePeptides(phdp, pep_mass2, toppep2, toppro2, xcorrPep2, vdXcorr_pep2, hist_pep2, &num_pep2, pQuery2, vPeptides);
 
-         if (toppep1[0] == NULL || toppep2[0] == NULL)
-            continue;
+      if (toppep1[0] == NULL || toppep2[0] == NULL)
+         continue;
 
-         double dSlope;
-         double dIntercept;
+      double dSlope;
+      double dIntercept;
 //       double dExpect;
 
-         // return dSlope and dIntercept for histogram
-         CalculateEValue(hist_pep1, num_pep1, &dSlope, &dIntercept,
-               pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1, pvSpectrumList.at(i).iScanNumber);
+      // return dSlope and dIntercept for histogram
+      CalculateEValue(vFits, hist_pep1, num_pep1, &dSlope, &dIntercept,
+            pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1, pQuery1);
 
-         if (g_staticParams.options.bVerboseOutput)
-         {
-            mango_print_histogram(hist_pep1);
-            cout << "Top "<< NUMPEPTIDES << " pep1 peptides for this scan are " << endl;
-         }
+      if (g_staticParams.options.bVerboseOutput)
+      {
+         mango_print_histogram(hist_pep1);
+         cout << "Top "<< NUMPEPTIDES << " pep1 peptides for this scan are " << endl;
+      }
 
-         double dExpect1 = 999;;
-         if (toppep1[0] != NULL)
+      double dExpect1 = 999;;
+      if (toppep1[0] != NULL)
+      {
+         if (dSlope > 0)
+            dExpect1 = 999;
+         else
+            dExpect1 = pow(10.0, dSlope * xcorrPep1[0] + dIntercept);
+      }
+/*
+      for (int li = 0 ; li < NUMPEPTIDES; li++)
+      {
+         if (toppep1[li] != NULL)
          {
             if (dSlope > 0)
-               dExpect1 = 999;
+               dExpect = 999;
             else
-               dExpect1 = pow(10.0, dSlope * xcorrPep1[0] + dIntercept);
-         }
-/*
-         for (int li = 0 ; li < NUMPEPTIDES; li++)
-         {
-            if (toppep1[li] != NULL)
-            {
-               if (dSlope > 0)
-                  dExpect = 999;
-               else
-                  dExpect = pow(10.0, dSlope * xcorrPep1[li] + dIntercept);
+               dExpect = pow(10.0, dSlope * xcorrPep1[li] + dIntercept);
 
-               if (li == 0)
-                  dExpect1 = dExpect;
+            if (li == 0)
+               dExpect1 = dExpect;
 
-               if (g_staticParams.options.bVerboseOutput)
-                  cout << "pep1_top: " << toppep1[li] << " xcorr " << xcorrPep1[li] << " expect " << dExpect << endl;
-            }
+            if (g_staticParams.options.bVerboseOutput)
+               cout << "pep1_top: " << toppep1[li] << " xcorr " << xcorrPep1[li] << " expect " << dExpect << endl;
          }
+      }
 */
 
-         fprintf(fptxt, "%d\t%f\t%f", pvSpectrumList.at(i).iScanNumber,
-               pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1,
-               pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2);
+      mango_append(strTxt, "%d\t%f\t%f", pvSpectrumList.at(i).iScanNumber,
+            pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1,
+            pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2);
 
-         if (toppep1[0] != NULL)
-            fprintf(fptxt, "\t%s\t%f\t%0.3E\t%f", toppep1[0], xcorrPep1[0], dExpect1, phdp->phd_calculate_mass_peptide(string(toppep1[0])));
-         else
-            fprintf(fptxt, "\t-\t0\t999\t0");
+      if (toppep1[0] != NULL)
+         mango_append(strTxt, "\t%s\t%f\t%0.3E\t%f", toppep1[0], xcorrPep1[0], dExpect1, phdp->phd_calculate_mass_peptide(string(toppep1[0])));
+      else
+         mango_append(strTxt, "\t-\t0\t999\t0");
 
-         CalculateEValue(hist_pep2, num_pep2, &dSlope, &dIntercept,
-               pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2, pvSpectrumList.at(i).iScanNumber);
+      CalculateEValue(vFits, hist_pep2, num_pep2, &dSlope, &dIntercept,
+            pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2, pQuery2);
 
-         if (g_staticParams.options.bVerboseOutput)
-         {
-            mango_print_histogram(hist_pep2);
-            cout << "Top "<< NUMPEPTIDES << " pep2 peptides for this scan are " << endl;
-         }
+      if (g_staticParams.options.bVerboseOutput)
+      {
+         mango_print_histogram(hist_pep2);
+         cout << "Top "<< NUMPEPTIDES << " pep2 peptides for this scan are " << endl;
+      }
 
-         double dExpect2 = 999;
-         if (toppep2[0] != NULL)
+      double dExpect2 = 999;
+      if (toppep2[0] != NULL)
+      {
+         if (dSlope > 0)
+            dExpect2 = 999;
+         else
+            dExpect2 = pow(10.0, dSlope * xcorrPep2[0] + dIntercept);
+      }
+/*
+      for (int li = 0; li < NUMPEPTIDES; li++)
+      {
+         if (toppep2[li] != NULL)
          {
             if (dSlope > 0)
-               dExpect2 = 999;
+               dExpect = 999;
             else
-               dExpect2 = pow(10.0, dSlope * xcorrPep2[0] + dIntercept);
-         }
-/*
-         for (int li = 0; li < NUMPEPTIDES; li++)
-         {
-            if (toppep2[li] != NULL)
-            {
-               if (dSlope > 0)
-                  dExpect = 999;
-               else
-                  dExpect = pow(10.0, dSlope * xcorrPep2[li] + dIntercept);
+               dExpect = pow(10.0, dSlope * xcorrPep2[li] + dIntercept);
 
-               if (li == 0)
-                  dExpect2 = dExpect;
+            if (li == 0)
+               dExpect2 = dExpect;
 
-               if (g_staticParams.options.bVerboseOutput)
-                  cout << "pep2_top: " << toppep2[li] << " xcorr " << xcorrPep2[li] << " expect " << dExpect << endl;
-            }
+            if (g_staticParams.options.bVerboseOutput)
+               cout << "pep2_top: " << toppep2[li] << " xcorr " << xcorrPep2[li] << " expect " << dExpect << endl;
          }
+      }
 */
 
-         if (toppep2[0] != NULL)
-            fprintf(fptxt, "\t%s\t%f\t%0.3E\t%f", toppep2[0], xcorrPep2[0], dExpect2, phdp->phd_calculate_mass_peptide(string(toppep2[0])));
-         else
-            fprintf(fptxt, "\t-\t0\t999\t0");
+      if (toppep2[0] != NULL)
+         mango_append(strTxt, "\t%s\t%f\t%0.3E\t%f", toppep2[0], xcorrPep2[0], dExpect2, phdp->phd_calculate_mass_peptide(string(toppep2[0])));
+      else
+         mango_append(strTxt, "\t-\t0\t999\t0");
 
-         if (g_staticParams.options.bVerboseOutput)
-            cout << "Size of peptide1 list is " << num_pep1 << " and the size of peptide2 list is " << num_pep2 << endl;
+      if (g_staticParams.options.bVerboseOutput)
+         cout << "Size of peptide1 list is " << num_pep1 << " and the size of peptide2 list is " << num_pep2 << endl;
 
-         // Compute histogram of combined scores;
-         for (int x=0; x<NUM_BINS; x++)
-            hist_combined[x] = 0;
+      // Compute histogram of combined scores;
+      for (int x=0; x<NUM_BINS; x++)
+         hist_combined[x] = 0;
  
+      if (g_staticParams.options.iExactCombinedHistogram)
+      {
          for (vector<double>::iterator x = vdXcorr_pep1.begin(); x != vdXcorr_pep1.end(); ++x)
          {
             for (vector<double>::iterator y = vdXcorr_pep2.begin(); y != vdXcorr_pep2.end(); ++y)
@@ -675,139 +989,128 @@ void mango_Search::SearchForPeptides(char *szMZXML,
                hist_combined[mango_get_histogram_bin_num(*x + *y)]++;
             }
          }
+      }
+      else
+         mango_convolve_histograms(vdXcorr_pep1, vdXcorr_pep2, hist_combined);
 
-         CalculateEValue(hist_combined, num_pep_combined, &dSlope, &dIntercept,
-               pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2, pvSpectrumList.at(i).iScanNumber);
+      CalculateEValue(hist_combined, num_pep_combined, &dSlope, &dIntercept,
+            pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2, pQuery2);
 
-         if (g_staticParams.options.bVerboseOutput)
-            mango_print_histogram(hist_combined);
+      if (g_staticParams.options.bVerboseOutput)
+         mango_print_histogram(hist_combined);
 
 
-         // take all combinations of top pep1 and pep2 and store best
-         for (int x = 0; x< NUMPEPTIDES - 1; x++)
+      // take all combinations of top pep1 and pep2 and store best
+      for (int x = 0; x< NUMPEPTIDES - 1; x++)
+      {
+         if (toppep1[x] != NULL)
          {
-            if (toppep1[x] != NULL)
+            for (int y = 0; y< NUMPEPTIDES - 1; y++)
             {
-               for (int y = 0; y< NUMPEPTIDES - 1; y++)
+               if (toppep2[y] != NULL)
                {
-                  if (toppep2[y] != NULL)
-                  {
-                     combinedPep = new char[strlen(toppep1[x]) + strlen(toppep2[y]) + 4];
-                     sprintf(combinedPep, "%s + %s", toppep1[x], toppep2[y]);
+                  combinedPep = new char[strlen(toppep1[x]) + strlen(toppep2[y]) + 4];
+                  sprintf(combinedPep, "%s + %s", toppep1[x], toppep2[y]);
 
-                     double dCombinedXcorr = xcorrPep1[x] + xcorrPep2[y];
+                  double dCombinedXcorr = xcorrPep1[x] + xcorrPep2[y];
 
-                     insert_pep_pq(toppepcombined, topprocombined, xcorrCombined, combinedPep, NULL, dCombinedXcorr);
-                  }
+                  insert_pep_pq(toppepcombined, topprocombined, xcorrCombined, combinedPep, NULL, dCombinedXcorr);
+                  delete [] combinedPep;
                }
             }
          }
+      }
 
-         double dExpectCombined = 999;
-         if (toppepcombined[0] != NULL)
-         {
-            if (dSlope > 0)
-               dExpectCombined = 999;
-            else
-               dExpectCombined = pow(10.0, dSlope * xcorrCombined[0] + dIntercept);
+      double dExpectCombined = 999;
+      if (toppepcombined[0] != NULL)
+      {
+         if (dSlope > 0)
+            dExpectCombined = 999;
+         else
+            dExpectCombined = pow(10.0, dSlope * xcorrCombined[0] + dIntercept);
 
-            fprintf(fptxt, "\t%f\t%0.3E\n",  xcorrCombined[0], dExpectCombined);
-         }
+         mango_append(strTxt, "\t%f\t%0.3E\n",  xcorrCombined[0], dExpectCombined);
+      }
 
 /*
-         for (int li = 0; li < NUMPEPTIDES; li++)
+      for (int li = 0; li < NUMPEPTIDES; li++)
+      {
+         if (toppepcombined[li] != NULL)
          {
-            if (toppepcombined[li] != NULL)
-            {
-               if (dSlope > 0)
-                  dExpect = 999;
-               else
-                  dExpect = pow(10.0, dSlope * xcorrCombined[li] + dIntercept);
+            if (dSlope > 0)
+               dExpect = 999;
+            else
+               dExpect = pow(10.0, dSlope * xcorrCombined[li] + dIntercept);
 
-               if (g_staticParams.options.bVerboseOutput)
-                  cout << "combined: " << toppepcombined[li] << " xcorr " << xcorrCombined[li] << " expect " << dExpect << endl;
+            if (g_staticParams.options.bVerboseOutput)
+               cout << "combined: " << toppepcombined[li] << " xcorr " << xcorrCombined[li] << " expect " << dExpect << endl;
 
-               if (li == 0)
-               {
-                  fprintf(fptxt, "\t%f\t%0.3E\n",  xcorrCombined[li], dExpect);
-                  dExpectCombined = dExpect;
-               }
+            if (li == 0)
+            {
+               mango_append(strTxt, "\t%f\t%0.3E\n",  xcorrCombined[li], dExpect);
+               dExpectCombined = dExpect;
             }
          }
+      }
 */
 
-         int iCharge = (pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge1>pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge2
-               ? pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge1
-               : pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge2);
+      int iCharge = (pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge1>pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge2
+            ? pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge1
+            : pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge2);
 
-         double dDeltaCn1, dDeltaCn2;
+      double dDeltaCn1, dDeltaCn2;
 
-         dDeltaCn1 = dDeltaCn2 = 0.0;
+      dDeltaCn1 = dDeltaCn2 = 0.0;
 
-         if (xcorrPep1[1] >= 0.0 && xcorrPep1[0] > 0.0)
-            dDeltaCn1 = (xcorrPep1[0] - xcorrPep1[1])/xcorrPep1[0];
-         if (xcorrPep2[1] >= 0.0 && xcorrPep2[0] > 0.0)
-            dDeltaCn2 = (xcorrPep2[0] - xcorrPep2[1])/xcorrPep2[0];
+      if (xcorrPep1[1] >= 0.0 && xcorrPep1[0] > 0.0)
+         dDeltaCn1 = (xcorrPep1[0] - xcorrPep1[1])/xcorrPep1[0];
+      if (xcorrPep2[1] >= 0.0 && xcorrPep2[0] > 0.0)
+         dDeltaCn2 = (xcorrPep2[0] - xcorrPep2[1])/xcorrPep2[0];
 
-         if (g_staticParams.options.iMimicCometPepXML)
-         {
-            WriteSplitSpectrumQuery(fpxml, szBaseName,
-                  pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1, pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2,
-                  xcorrPep1[0], xcorrPep2[0],
-                  dDeltaCn1, dDeltaCn2,
-                  dExpect1, dExpect2,
-                  phdp->phd_calculate_mass_peptide(string(toppep1[0])), phdp->phd_calculate_mass_peptide(string(toppep2[0])),
-                  toppep1[0], toppep2[0],
-                  toppro1[0], toppro2[0],
-                  pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge1,
-                  pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge2,
-                  iIndex, pvSpectrumList.at(i).iScanNumber,
-                  ii);
-         }
-         else
-         {
-            WriteSpectrumQuery(fpxml, szBaseName,
-                  pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1, pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2,
-                  xcorrPep1[0], xcorrPep2[0],
-                  dDeltaCn1, dDeltaCn2,
-                  dExpect1, dExpect2,
-                  phdp->phd_calculate_mass_peptide(string(toppep1[0])), phdp->phd_calculate_mass_peptide(string(toppep2[0])),
-                  xcorrCombined[0], dExpectCombined,
-                  toppep1[0], toppep2[0],
-                  toppro1[0], toppro2[0],
-                  iCharge,                                     // report largest charge of the two released peptides
-                  iIndex, pvSpectrumList.at(i).iScanNumber);
-         }
+      if (g_staticParams.options.iMimicCometPepXML)
+      {
+         WriteSplitSpectrumQuery(strXml, szBaseName,
+               pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1, pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2,
+               xcorrPep1[0], xcorrPep2[0],
+               dDeltaCn1, dDeltaCn2,
+               dExpect1, dExpect2,
+               phdp->phd_calculate_mass_peptide(string(toppep1[0])), phdp->phd_calculate_mass_peptide(string(toppep2[0])),
+               toppep1[0], toppep2[0],
+               toppro1[0], toppro2[0],
+               pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge1,
+               pvSpectrumList.at(i).pvdPrecursors.at(ii).iCharge2,
+               iIndex, pvSpectrumList.at(i).iScanNumber,
+               ii);
       }
-
-      for (int y=0; y<(int)g_pvQuery.size(); y++)
+      else
       {
-         // need to free processed spectrum data here
-         for (int x=0;x<g_pvQuery.at(y)->iFastXcorrData;x++)
-         {
-            if (g_pvQuery.at(y)->ppfSparseFastXcorrData[x] != NULL)
-               delete[] g_pvQuery.at(y)->ppfSparseFastXcorrData[x];
-         }
+         WriteSpectrumQuery(strXml, szBaseName,
+               pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass1, pvSpectrumList.at(i).pvdPrecursors.at(ii).dNeutralMass2,
+               xcorrPep1[0], xcorrPep2[0],
+               dDeltaCn1, dDeltaCn2,
+               dExpect1, dExpect2,
+               phdp->phd_calculate_mass_peptide(string(toppep1[0])), phdp->phd_calculate_mass_peptide(string(toppep2[0])),
+               xcorrCombined[0], dExpectCombined,
+               toppep1[0], toppep2[0],
+               toppro1[0], toppro2[0],
+               iCharge,                                     // report largest charge of the two released peptides
+               iIndex, pvSpectrumList.at(i).iScanNumber);
       }
+   }
 
-      g_pvQuery.clear();
+   free_pep_pq(toppep1, toppro1);
+   free_pep_pq(toppep2, toppro2);
+   free_pep_pq(toppepcombined, topprocombined);
 
-      if (!g_staticParams.options.bVerboseOutput)
+   if (g_staticParams.options.iFloatPreprocessing == 2)
+   {
+      std::lock_guard<std::mutex> lock(_checkMutex);
+      for (ii=0; ii<(int)queryContext.vpQuery.size(); ii++)
       {
-         printf("%5.1f%%", (float)(100.0*i/pvSpectrumList.size()));
-         fflush(stdout);
-         printf("\b\b\b\b\b\b");
+         if (queryContext.vpQuery.at(ii)->dMaxCheckDeviation > _dMaxCheckDeviation)
+            _dMaxCheckDeviation = queryContext.vpQuery.at(ii)->dMaxCheckDeviation;
       }
-// } //scan range restriction
    }
-
-   mango_preprocess::DeallocateMemory(1);
-
-   fprintf(fpxml, "  </msms_run_summary>\n");
-   fprintf(fpxml, "</msms_pipeline_analysis>\n");
-
-   fclose(fptxt);
-   fclose(fpxml);
 }
 
 
@@ -819,14 +1122,13 @@ void mango_Search::ScorePeptides(protein_hash_db_t phdp,
                                  vector<double> &vdXcorr_pep,
                                  int *hist_pep,
                                  int *num_pep,
-                                 int iScanNumber)
+                                 Query *pQuery,
+                                 vector<phd_peptide_view> &vPeptides)
 {
    int y;
    double dXcorr = 0.0;
    double dTolerance = (g_staticParams.tolerances.dTolerancePeptide * (pep_mass)) / 1e6;
    double dSilacMass = 0.0;
-   char *szPeptide;
-   char *szProtein;
 
    // bSilac
    for (y=0; y<2; y++)
@@ -844,14 +1146,12 @@ void mango_Search::ScorePeptides(protein_hash_db_t phdp,
 
       for (int x=0; x<3; x++)
       {
-         vector<peptide_hash_database::phd_peptide> *peptides = phdp->phd_get_peptides_ofmass_tolerance(pep_mass - dSilacMass - x*1.003355, dTolerance);
+         phdp->phd_get_peptide_views_ofmass_tolerance(pep_mass - dSilacMass - x*1.003355, dTolerance, vPeptides);
          
-         for (peptide_hash_database::phd_peptide peptide : *peptides)
+         for (const phd_peptide_view &peptide : vPeptides)
          {
-            szPeptide = new char[peptide.phdpep_sequence().length() + 1];
-            strcpy(szPeptide, (peptide.phdpep_sequence()).c_str() );
-            szProtein = new char[peptide.phdpep_protein_list(0).phdpro_name().length() + 1];
-            strcpy(szProtein, (peptide.phdpep_protein_list(0).phdpro_name()).c_str() );
+            const char *szPeptide = peptide.phdpv_sequence;
+            const char *szProtein = phdp->phd_get_protein_name(peptide, 0);
 
             // sanity check to ignore peptides w/unknown AA residues
             // should not be needed now that this is addressed in the hash building
@@ -862,11 +1162,11 @@ void mango_Search::ScorePeptides(protein_hash_db_t phdp,
          
                if (g_staticParams.options.iSilacHeavy)
                {
-                  if ((y==0 && szPeptide[strlen(szPeptide)-1]=='K') || (y==1 && szPeptide[strlen(szPeptide)-1]=='R')) // SILAC
-                     dXcorr = XcorrScore(szPeptide, iScanNumber);
+                  if ((y==0 && szPeptide[peptide.phdpv_length-1]=='K') || (y==1 && szPeptide[peptide.phdpv_length-1]=='R')) // SILAC
+                     dXcorr = XcorrScore(peptide, pQuery);
                }
                else
-                  dXcorr = XcorrScore(szPeptide, iScanNumber);
+                  dXcorr = XcorrScore(peptide, pQuery);
          
             }
          
@@ -878,33 +1178,64 @@ void mango_Search::ScorePeptides(protein_hash_db_t phdp,
             if (g_staticParams.options.bVerboseOutput)
                cout << "pep: " << szPeptide << "  xcorr " << dXcorr << "  protein " << szProtein << endl;
          }
-         
-         (*peptides).clear();
-
       }
    }
 }
 
 
+// Precursor pairs of a scan often share a peptide mass, or have overlapping mass
+// windows, so each database peptide is scored only once against a query.  The memo is
+// released along with the scan's queries.
+double mango_Search::XcorrScore(const phd_peptide_view &peptide,
+                                Query *pQuery)
+{
+   if (pQuery == NULL)
+      return XcorrScore(peptide.phdpv_sequence, pQuery);
+
+   unordered_map<uint64_t, double>::iterator it = pQuery->mapXcorrMemo.find(peptide.phdpv_id);
+   if (it != pQuery->mapXcorrMemo.end())
+      return it->second;
+
+   double dXcorr = XcorrScore(peptide.phdpv_sequence, pQuery);
+   pQuery->mapXcorrMemo[peptide.phdpv_id] = dXcorr;
+
+   return dXcorr;
+}
+
+
+// With float_preprocessing 2 each score is also computed against the double
+// precision spectrum and the largest difference is kept on the query.
 double mango_Search::XcorrScore(const char *szPeptide,
-                                int iScanNumber)
+                                Query *pQuery)
 {
+   if (pQuery == NULL)
+      return XcorrScore(szPeptide, pQuery, NULL);
 
-   int iWhichQuery;
-   int iLenPeptide = strlen(szPeptide);
-   double dXcorr = 0.0;
+   double dXcorr = XcorrScore(szPeptide, pQuery, pQuery->ppfSparseFastXcorrData);
 
-   // find which
-   for (iWhichQuery=0; iWhichQuery<(int)g_pvQuery.size(); iWhichQuery++)
+   if (pQuery->ppfCheckFastXcorrData != NULL)
    {
-      if (g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iScanNumber == iScanNumber)
-         break;
+      double dDeviation = fabs(dXcorr - XcorrScore(szPeptide, pQuery, pQuery->ppfCheckFastXcorrData));
+
+      if (dDeviation > pQuery->dMaxCheckDeviation)
+         pQuery->dMaxCheckDeviation = dDeviation;
    }
 
-   if (iWhichQuery < (int)g_pvQuery.size() && g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iScanNumber == iScanNumber)
+   return dXcorr;
+}
+
+
+double mango_Search::XcorrScore(const char *szPeptide,
+                                Query *pQuery,
+                                float **ppfSparseFastXcorrData)
+{
+   int iLenPeptide = strlen(szPeptide);
+   double dXcorr = 0.0;
+
+   if (pQuery != NULL)
    {
       int bin, x, y;
-      int iMax = g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iArraySize/SPARSE_MATRIX_SIZE + 1;
+      int iMax = pQuery->_spectrumInfoInternal.iArraySize/SPARSE_MATRIX_SIZE + 1;
 
       double dBion = g_staticParams.precalcMasses.dNtermProton;
       double dYion = g_staticParams.precalcMasses.dCtermOH2Proton;
@@ -930,10 +1261,10 @@ double mango_Search::XcorrScore(const char *szPeptide,
 
          bin = BIN(dBion);
          x =  bin / SPARSE_MATRIX_SIZE;
-         if (!(g_pvQuery.at(iWhichQuery)->ppfSparseFastXcorrData[x]==NULL || x>iMax)) // x should never be > iMax so this is just a safety check
+         if (!(ppfSparseFastXcorrData[x]==NULL || x>iMax)) // x should never be > iMax so this is just a safety check
          {
             y = bin - (x*SPARSE_MATRIX_SIZE);
-            dXcorr += g_pvQuery.at(iWhichQuery)->ppfSparseFastXcorrData[x][y];
+            dXcorr += ppfSparseFastXcorrData[x][y];
          }
 
          dYion += g_staticParams.massUtility.pdAAMassFragment[(int)szPeptide[iLenPeptide -1 - i]];
@@ -952,10 +1283,10 @@ double mango_Search::XcorrScore(const char *szPeptide,
 
          bin = BIN(dYion);
          x =  bin / SPARSE_MATRIX_SIZE;
-         if (!(g_pvQuery.at(iWhichQuery)->ppfSparseFastXcorrData[x]==NULL || x>iMax)) // x should never be > iMax so this is just a safety check
+         if (!(ppfSparseFastXcorrData[x]==NULL || x>iMax)) // x should never be > iMax so this is just a safety check
          {
             y = bin - (x*SPARSE_MATRIX_SIZE);
-            dXcorr += g_pvQuery.at(iWhichQuery)->ppfSparseFastXcorrData[x][y];
+            dXcorr += ppfSparseFastXcorrData[x][y];
          }
       }
 
@@ -1015,7 +1346,7 @@ void mango_Search::WritePepXMLHeader(FILE *fpxml,
 }
 
 
-void mango_Search::WriteSpectrumQuery(FILE *fpxml,
+void mango_Search::WriteSpectrumQuery(string &strXml,
                                        char *szBaseName,
                                        double dExpMass1,
                                        double dExpMass2,
@@ -1043,60 +1374,60 @@ void mango_Search::WriteSpectrumQuery(FILE *fpxml,
    dCalcMass1 += g_staticParams.options.dLysineStumpMass + g_staticParams.massUtility.pdAAMassFragment['o'] + 2*g_staticParams.massUtility.pdAAMassFragment['h'];
    dCalcMass2 += g_staticParams.options.dLysineStumpMass + g_staticParams.massUtility.pdAAMassFragment['o'] + 2*g_staticParams.massUtility.pdAAMassFragment['h'];
 
-   fprintf(fpxml, "  <spectrum_query spectrum=\"%s.%05d.%05d.%d\" start_scan=\"%d\" end_scan=\"%d\" precursor_neutral_mass=\"%0.6f\" assumed_charge=\"%d\" index=\"%d\">\n",
+   mango_append(strXml, "  <spectrum_query spectrum=\"%s.%05d.%05d.%d\" start_scan=\"%d\" end_scan=\"%d\" precursor_neutral_mass=\"%0.6f\" assumed_charge=\"%d\" index=\"%d\">\n",
          szBaseName, iScan, iScan, iCharge, iScan, iScan, dExpMass1+dExpMass2+g_staticParams.options.dReporterMass, iCharge, ++iIndex);
-   fprintf(fpxml, "   <search_result>\n");
-   fprintf(fpxml, "    <search_hit hit_rank=\"1\" peptide=\"-\" peptide_prev_aa=\"-\" peptide_next_aa=\"-\" protein=\"-\" num_tot_proteins=\"1\" calc_neutral_pep_mass=\"%0.6f\" massdiff=\"%0.6f\" xlink_type=\"xl\">\n",
+   mango_append(strXml, "   <search_result>\n");
+   mango_append(strXml, "    <search_hit hit_rank=\"1\" peptide=\"-\" peptide_prev_aa=\"-\" peptide_next_aa=\"-\" protein=\"-\" num_tot_proteins=\"1\" calc_neutral_pep_mass=\"%0.6f\" massdiff=\"%0.6f\" xlink_type=\"xl\">\n",
          dCalcMass1, (dCalcMass1+dCalcMass2)-(dExpMass1+dExpMass2));
-   fprintf(fpxml, "     <xlink identifier=\"BDP-NHP\" mass=\"200.00\">\n");
-   fprintf(fpxml, "      <linked_peptide peptide=\"%s\" peptide_prev_aa=\"-\" peptide_next_aa=\"-\" protein=\"%s\" num_tot_proteins=\"1\" calc_neutral_pep_mass=\"%0.6f\" complement_mass=\"%0.6f\" precursor_neutral_mass=\"%0.6f\" designation=\"alpha\">\n",
+   mango_append(strXml, "     <xlink identifier=\"BDP-NHP\" mass=\"200.00\">\n");
+   mango_append(strXml, "      <linked_peptide peptide=\"%s\" peptide_prev_aa=\"-\" peptide_next_aa=\"-\" protein=\"%s\" num_tot_proteins=\"1\" calc_neutral_pep_mass=\"%0.6f\" complement_mass=\"%0.6f\" precursor_neutral_mass=\"%0.6f\" designation=\"alpha\">\n",
          szPep1, szProt1, dCalcMass1, dCalcMass1, dExpMass1);
-   fprintf(fpxml, "       <modification_info>\n");
+   mango_append(strXml, "       <modification_info>\n");
    for (i=0; i<(int)strlen(szPep1); i++)
       if (szPep1[i]=='K')
          break;
-   fprintf(fpxml, "        <mod_aminoacid_mass position=\"%d\" mass=\"325.127385\"/>\n", i+1);
+   mango_append(strXml, "        <mod_aminoacid_mass position=\"%d\" mass=\"325.127385\"/>\n", i+1);
    for (i=0; i<(int)strlen(szPep1); i++)
       if (szPep1[i]=='C')
-         fprintf(fpxml, "        <mod_aminoacid_mass position=\"%d\" mass=\"160.03064805\"/>\n", i+1);
-   fprintf(fpxml, "       </modification_info>\n");
-   fprintf(fpxml, "       <xlink_score name=\"score\" value=\"%0.3E\"/>\n", dExpect1);
-   fprintf(fpxml, "       <xlink_score name=\"xcorr\" value=\"%0.3f\"/>\n", dXcorr1);
-   fprintf(fpxml, "       <xlink_score name=\"deltacn\" value=\"%0.3f\"/>\n", dDeltaCn1);
-   fprintf(fpxml, "      </linked_peptide>\n");
-   fprintf(fpxml, "      <linked_peptide peptide=\"%s\" peptide_prev_aa=\"-\" peptide_next_aa=\"-\" protein=\"%s\" num_tot_proteins=\"1\" calc_neutral_pep_mass=\"%0.6f\" complement_mass=\"%0.6f\" precursor_neutral_mass=\"%0.6f\" designation=\"beta\">\n",
+         mango_append(strXml, "        <mod_aminoacid_mass position=\"%d\" mass=\"160.03064805\"/>\n", i+1);
+   mango_append(strXml, "       </modification_info>\n");
+   mango_append(strXml, "       <xlink_score name=\"score\" value=\"%0.3E\"/>\n", dExpect1);
+   mango_append(strXml, "       <xlink_score name=\"xcorr\" value=\"%0.3f\"/>\n", dXcorr1);
+   mango_append(strXml, "       <xlink_score name=\"deltacn\" value=\"%0.3f\"/>\n", dDeltaCn1);
+   mango_append(strXml, "      </linked_peptide>\n");
+   mango_append(strXml, "      <linked_peptide peptide=\"%s\" peptide_prev_aa=\"-\" peptide_next_aa=\"-\" protein=\"%s\" num_tot_proteins=\"1\" calc_neutral_pep_mass=\"%0.6f\" complement_mass=\"%0.6f\" precursor_neutral_mass=\"%0.6f\" designation=\"beta\">\n",
          szPep2, szProt2, dCalcMass2, dCalcMass2, dExpMass2);
-   fprintf(fpxml, "       <modification_info>\n");
+   mango_append(strXml, "       <modification_info>\n");
    for (i=0; i<(int)strlen(szPep2); i++)
       if (szPep2[i]=='K')
          break;
-   fprintf(fpxml, "        <mod_aminoacid_mass position=\"%d\" mass=\"325.127385\"/>\n", i+1);
+   mango_append(strXml, "        <mod_aminoacid_mass position=\"%d\" mass=\"325.127385\"/>\n", i+1);
    for (i=0; i<(int)strlen(szPep2); i++)
       if (szPep2[i]=='C')
-         fprintf(fpxml, "        <mod_aminoacid_mass position=\"%d\" mass=\"160.03046805\"/>\n", i+1);
-   fprintf(fpxml, "       </modification_info>\n");
-   fprintf(fpxml, "       <xlink_score name=\"score\" value=\"%0.3E\"/>\n", dExpect2);
-   fprintf(fpxml, "       <xlink_score name=\"delta_score\" value=\"%0.3f\"/>\n", dXcorr2);
-   fprintf(fpxml, "       <xlink_score name=\"deltacn\" value=\"%0.3f\"/>\n", dDeltaCn2);
-   fprintf(fpxml, "      </linked_peptide>\n");
-   fprintf(fpxml, "     </xlink>\n");
+         mango_append(strXml, "        <mod_aminoacid_mass position=\"%d\" mass=\"160.03046805\"/>\n", i+1);
+   mango_append(strXml, "       </modification_info>\n");
+   mango_append(strXml, "       <xlink_score name=\"score\" value=\"%0.3E\"/>\n", dExpect2);
+   mango_append(strXml, "       <xlink_score name=\"delta_score\" value=\"%0.3f\"/>\n", dXcorr2);
+   mango_append(strXml, "       <xlink_score name=\"deltacn\" value=\"%0.3f\"/>\n", dDeltaCn2);
+   mango_append(strXml, "      </linked_peptide>\n");
+   mango_append(strXml, "     </xlink>\n");
 
    double dScore =  dExpect1 > dExpect2 ? dExpect1 : dExpect2;
    if (g_staticParams.options.iReportedScore == 1)
       dScore = dExpectCombined;
 
-   fprintf(fpxml, "     <search_score name=\"kojak_score\" value=\"%0.3E\"/>\n", dScore);
-   fprintf(fpxml, "     <search_score name=\"delta_score\" value=\"0.0\"/>\n"); //dXcorrCombined);
-   fprintf(fpxml, "     <search_score name=\"ppm_error\" value=\"0.0\"/>\n");
-   fprintf(fpxml, "     <search_score name=\"xcorr_combined\" value=\"%0.3f\"/>\n", dXcorrCombined);
-   fprintf(fpxml, "    </search_hit>\n");
-   fprintf(fpxml, "   </search_result>\n");
-   fprintf(fpxml, "  </spectrum_query>\n");
+   mango_append(strXml, "     <search_score name=\"kojak_score\" value=\"%0.3E\"/>\n", dScore);
+   mango_append(strXml, "     <search_score name=\"delta_score\" value=\"0.0\"/>\n"); //dXcorrCombined);
+   mango_append(strXml, "     <search_score name=\"ppm_error\" value=\"0.0\"/>\n");
+   mango_append(strXml, "     <search_score name=\"xcorr_combined\" value=\"%0.3f\"/>\n", dXcorrCombined);
+   mango_append(strXml, "    </search_hit>\n");
+   mango_append(strXml, "   </search_result>\n");
+   mango_append(strXml, "  </spectrum_query>\n");
 
 }
 
 
-void mango_Search::WriteSplitSpectrumQuery(FILE *fpxml,
+void mango_Search::WriteSplitSpectrumQuery(string &strXml,
                                            char *szBaseName,
                                            double dExpMass1,
                                            double dExpMass2,
@@ -1125,54 +1456,54 @@ void mango_Search::WriteSplitSpectrumQuery(FILE *fpxml,
    dCalcMass2 += g_staticParams.options.dLysineStumpMass + g_staticParams.massUtility.pdAAMassFragment['o'] + 2*g_staticParams.massUtility.pdAAMassFragment['h'];
 
    // write first peptide
-   fprintf(fpxml, "  <spectrum_query spectrum=\"%s_%03d.%06d.%06d.%d\" start_scan=\"%d\" end_scan=\"%d\" precursor_neutral_mass=\"%0.6f\" assumed_charge=\"%d\" index=\"%d\">\n",
+   mango_append(strXml, "  <spectrum_query spectrum=\"%s_%03d.%06d.%06d.%d\" start_scan=\"%d\" end_scan=\"%d\" precursor_neutral_mass=\"%0.6f\" assumed_charge=\"%d\" index=\"%d\">\n",
          szBaseName, iWhichDuplicatePrecursor, iScan, iScan, iCharge1, iScan, iScan, dExpMass1+dExpMass2+g_staticParams.options.dReporterMass, iCharge1, ++iIndex);
-   fprintf(fpxml, "   <search_result>\n");
-   fprintf(fpxml, "    <search_hit hit_rank=\"1\" peptide=\"%s\" peptide_prev_aa=\"-\" peptide_next_aa=\"-\" protein=\"%s\" num_tot_proteins=\"1\" calc_neutral_pep_mass=\"%0.6f\" massdiff=\"%0.6f\">\n",
+   mango_append(strXml, "   <search_result>\n");
+   mango_append(strXml, "    <search_hit hit_rank=\"1\" peptide=\"%s\" peptide_prev_aa=\"-\" peptide_next_aa=\"-\" protein=\"%s\" num_tot_proteins=\"1\" calc_neutral_pep_mass=\"%0.6f\" massdiff=\"%0.6f\">\n",
          szPep1, szProt1, dCalcMass1, dExpMass1-dCalcMass1);
-   fprintf(fpxml, "     <modification_info>\n");
+   mango_append(strXml, "     <modification_info>\n");
    for (i=0; i<(int)strlen(szPep1); i++)
       if (szPep1[i]=='K')
          break;
-   fprintf(fpxml, "      <mod_aminoacid_mass position=\"%d\" mass=\"325.127385\"/>\n", i+1);
+   mango_append(strXml, "      <mod_aminoacid_mass position=\"%d\" mass=\"325.127385\"/>\n", i+1);
    for (i=0; i<(int)strlen(szPep1); i++)
       if (szPep1[i]=='C')
-         fprintf(fpxml, "      <mod_aminoacid_mass position=\"%d\" mass=\"160.03064805\"/>\n", i+1);
-   fprintf(fpxml, "     </modification_info>\n");
-   fprintf(fpxml, "     <search_score name=\"xcorr\" value=\"%0.3f\"/>\n", dXcorr1);
-   fprintf(fpxml, "     <search_score name=\"deltacn\" value=\"%0.3f\"/>\n", dDeltaCn1);
-   fprintf(fpxml, "     <search_score name=\"deltacnstar\" value=\"0.0\"/>\n");
-   fprintf(fpxml, "     <search_score name=\"spscore\" value=\"1.0\"/>\n");
-   fprintf(fpxml, "     <search_score name=\"sprank\" value=\"1\"/>\n");
-   fprintf(fpxml, "     <search_score name=\"expect\" value=\"%0.3E\"/>\n", dExpect1);
-   fprintf(fpxml, "    </search_hit>\n");
-   fprintf(fpxml, "   </search_result>\n");
-   fprintf(fpxml, "  </spectrum_query>\n");
+         mango_append(strXml, "      <mod_aminoacid_mass position=\"%d\" mass=\"160.03064805\"/>\n", i+1);
+   mango_append(strXml, "     </modification_info>\n");
+   mango_append(strXml, "     <search_score name=\"xcorr\" value=\"%0.3f\"/>\n", dXcorr1);
+   mango_append(strXml, "     <search_score name=\"deltacn\" value=\"%0.3f\"/>\n", dDeltaCn1);
+   mango_append(strXml, "     <search_score name=\"deltacnstar\" value=\"0.0\"/>\n");
+   mango_append(strXml, "     <search_score name=\"spscore\" value=\"1.0\"/>\n");
+   mango_append(strXml, "     <search_score name=\"sprank\" value=\"1\"/>\n");
+   mango_append(strXml, "     <search_score name=\"expect\" value=\"%0.3E\"/>\n", dExpect1);
+   mango_append(strXml, "    </search_hit>\n");
+   mango_append(strXml, "   </search_result>\n");
+   mango_append(strXml, "  </spectrum_query>\n");
 
    // write second peptide
    iScan += 100000;
-   fprintf(fpxml, "  <spectrum_query spectrum=\"%s_%03d.%06d.%06d.%d\" start_scan=\"%d\" end_scan=\"%d\" precursor_neutral_mass=\"%0.6f\" assumed_charge=\"%d\" index=\"%d\">\n",
+   mango_append(strXml, "  <spectrum_query spectrum=\"%s_%03d.%06d.%06d.%d\" start_scan=\"%d\" end_scan=\"%d\" precursor_neutral_mass=\"%0.6f\" assumed_charge=\"%d\" index=\"%d\">\n",
          szBaseName, iWhichDuplicatePrecursor, iScan, iScan, iCharge2, iScan, iScan, dExpMass1+dExpMass2+g_staticParams.options.dReporterMass, iCharge2, ++iIndex);
-   fprintf(fpxml, "   <search_result>\n");
-   fprintf(fpxml, "    <search_hit hit_rank=\"1\" peptide=\"%s\" peptide_prev_aa=\"-\" peptide_next_aa=\"-\" protein=\"%s\" num_tot_proteins=\"1\" calc_neutral_pep_mass=\"%0.6f\" massdiff=\"%0.6f\">\n",
+   mango_append(strXml, "   <search_result>\n");
+   mango_append(strXml, "    <search_hit hit_rank=\"1\" peptide=\"%s\" peptide_prev_aa=\"-\" peptide_next_aa=\"-\" protein=\"%s\" num_tot_proteins=\"1\" calc_neutral_pep_mass=\"%0.6f\" massdiff=\"%0.6f\">\n",
          szPep2, szProt2, dCalcMass2, dExpMass2-dCalcMass2);
-   fprintf(fpxml, "     <modification_info>\n");
+   mango_append(strXml, "     <modification_info>\n");
    for (i=0; i<(int)strlen(szPep2); i++)
       if (szPep2[i]=='K')
          break;
-   fprintf(fpxml, "      <mod_aminoacid_mass position=\"%d\" mass=\"325.127385\"/>\n", i+1);
+   mango_append(strXml, "      <mod_aminoacid_mass position=\"%d\" mass=\"325.127385\"/>\n", i+1);
    for (i=0; i<(int)strlen(szPep2); i++)
       if (szPep2[i]=='C')
-         fprintf(fpxml, "      <mod_aminoacid_mass position=\"%d\" mass=\"160.03064805\"/>\n", i+1);
-   fprintf(fpxml, "     </modification_info>\n");
-   fprintf(fpxml, "     <search_score name=\"xcorr\" value=\"%0.3f\"/>\n", dXcorr2);
-   fprintf(fpxml, "     <search_score name=\"deltacn\" value=\"%0.3f\"/>\n", dDeltaCn2);
-   fprintf(fpxml, "     <search_score name=\"deltacnstar\" value=\"0.0\"/>\n");
-   fprintf(fpxml, "     <search_score name=\"spscore\" value=\"1.0\"/>\n");
-   fprintf(fpxml, "     <search_score name=\"sprank\" value=\"1\"/>\n");
-   fprintf(fpxml, "     <search_score name=\"expect\" value=\"%0.3E\"/>\n", dExpect2);
-   fprintf(fpxml, "    </search_hit>\n");
-   fprintf(fpxml, "   </search_result>\n");
-   fprintf(fpxml, "  </spectrum_query>\n");
+         mango_append(strXml, "      <mod_aminoacid_mass position=\"%d\" mass=\"160.03064805\"/>\n", i+1);
+   mango_append(strXml, "     </modification_info>\n");
+   mango_append(strXml, "     <search_score name=\"xcorr\" value=\"%0.3f\"/>\n", dXcorr2);
+   mango_append(strXml, "     <search_score name=\"deltacn\" value=\"%0.3f\"/>\n", dDeltaCn2);
+   mango_append(strXml, "     <search_score name=\"deltacnstar\" value=\"0.0\"/>\n");
+   mango_append(strXml, "     <search_score name=\"spscore\" value=\"1.0\"/>\n");
+   mango_append(strXml, "     <search_score name=\"sprank\" value=\"1\"/>\n");
+   mango_append(strXml, "     <search_score name=\"expect\" value=\"%0.3E\"/>\n", dExpect2);
+   mango_append(strXml, "    </search_hit>\n");
+   mango_append(strXml, "   </search_result>\n");
+   mango_append(strXml, "  </spectrum_query>\n");
 }
 
@@ -21,6 +21,19 @@
 #include "hash/mango-hash.h"
 
 #define NUMPEPTIDES 10
+#define PREFETCH_SCANS_PER_THREAD 2    // decoded spectra queued ahead of each search thread
+
+struct SearchThreadData;
+
+// E-value fit of the histogram of one released peptide mass.  Precursor pairs of a
+// scan often share a side so fits are kept and reused for the rest of the scan.
+struct HistogramFit
+{
+   double dNeutralPepMass;
+   Query *pQuery;
+   double dSlope;
+   double dIntercept;
+};
 
 class mango_Search
 {
@@ -30,11 +43,24 @@ public:
 
    static void SearchForPeptides(char *szMZXML,
                                  const char *,
-                                 enzyme_cut_params,
-                                 const char *);
+                                 protein_hash_db_t);
+
+   static void InitializeDecoyBins();
 
 private:
 
+   static void ReaderThreadProc(SearchThreadData *pData);
+
+   static void SearchThreadProc(SearchThreadData *pData);
+
+   static void SearchScan(int iWhichScan,
+                          Spectrum &mstSpectrum,
+                          protein_hash_db_t phdp,
+                          char *szBaseName,
+                          vector<phd_peptide_view> &vPeptides,
+                          string &strTxt,
+                          string &strXml);
+
    static void ScorePeptides(protein_hash_db_t phdp,
                              double pep_mass,
                              char *toppep[NUMPEPTIDES],
@@ -43,17 +69,33 @@ private:
                              vector<double> &vdXcorr_pep,
                              int *hist_pep,
                              int *num_pep,
-                             int iScanNumber);
+                             Query *pQuery,
+                             vector<phd_peptide_view> &vPeptides);
 
    static double XcorrScore(const char *szPeptide,
-                            int iScanNumber);
+                            Query *pQuery);
+
+   static double XcorrScore(const char *szPeptide,
+                            Query *pQuery,
+                            float **ppfSparseFastXcorrData);
+
+   static double XcorrScore(const phd_peptide_view &peptide,
+                            Query *pQuery);
+
+   static bool CalculateEValue(vector<HistogramFit> &vFits,
+                               int *hist_pep,
+                               int iMatchPepCount,
+                               double *dSlope,
+                               double *dIntercept,
+                               double dNeutralPepMass,
+                               Query *pQuery);
 
    static bool CalculateEValue(int *hist_pep,
                                int iMatchPepCount,
                                double *dSlope,
                                double *dIntercept,
                                double dNeutralPepMass,
-                               int iScanNumber);
+                               Query *pQuery);
 
    static void LinearRegression(int *piHistogram,
                                 double *slope,
@@ -65,14 +107,14 @@ private:
    static bool GenerateXcorrDecoys(double dNeutralPepMass,
                                    int iMatchPepCount,
                                    int *hist_pep,
-                                   int iScanNumber);
+                                   Query *pQuery);
 
    static void WritePepXMLHeader(FILE *fpxml,
                                  char *szBaseName,
                                  const char *szFastaFile,
                                  bool bMimicComet);
 
-   static void WriteSpectrumQuery(FILE *fpxml,
+   static void WriteSpectrumQuery(string &strXml,
                                   char *szBaseName,
                                   double dExpMass1,
                                   double dExpMass2,
@@ -94,7 +136,7 @@ private:
                                   int iIndex,
                                   int iScan);
 
-   static void WriteSplitSpectrumQuery(FILE *fpxml,
+   static void WriteSplitSpectrumQuery(string &strXml,
                                        char *szBaseName,
                                        double dExpMass1,
                                        double dExpMass2,
@@ -119,6 +161,8 @@ private:
    // Private static methods
 
    // Private member variables
+   static double _dMaxCheckDeviation;   // float_preprocessing 2: largest xcorr difference to the double path
+   static std::mutex _checkMutex;       // guards _dMaxCheckDeviation
 };
 
 #endif // _MANGOREADFASTA_H_
@@ -18,11 +18,11 @@
 #include "mango_Search.h"
 #include "mango_Preprocess.h"
 #include "mango_DataInternal.h"
+#include "mango_Hardklor.h"
 #include "mango_SearchManager.h"
 
 #undef PERF_DEBUG
 
-std::vector<Query*>           g_pvQuery;
 std::vector<InputFileInfo *>  g_pvInputFiles;
 StaticParams                  g_staticParams;
 MassRange                     g_massRange;
@@ -63,6 +63,12 @@ bool MangoSearchManager::InitializeStaticParams()
    if (GetParamValue("fasta_hash", strData))
       strcpy(g_staticParams.databaseInfo.szHash, strData.c_str());
 
+   if (GetParamValue("hardklor_isotope_data", strData))
+      strcpy(g_staticParams.options.szHardklorIsotopeData, strData.c_str());
+
+   if (GetParamValue("hardklor_data", strData))
+      strcpy(g_staticParams.options.szHardklorData, strData.c_str());
+
    GetParamValue("mass_tolerance_fragment", g_staticParams.tolerances.dFragmentBinSize);
    if (g_staticParams.tolerances.dFragmentBinSize < 0.01)
       g_staticParams.tolerances.dFragmentBinSize = 0.01;
@@ -75,6 +81,15 @@ bool MangoSearchManager::InitializeStaticParams()
    GetParamValue("reported_score", g_staticParams.options.iReportedScore);
    GetParamValue("silac_heavy", g_staticParams.options.iSilacHeavy);
    GetParamValue("dump_relationship_data", g_staticParams.options.iDumpRelationshipData);
+   GetParamValue("num_threads", g_staticParams.options.iNumThreads);
+   GetParamValue("exact_combined_histogram", g_staticParams.options.iExactCombinedHistogram);
+   GetParamValue("float_preprocessing", g_staticParams.options.iFloatPreprocessing);
+
+   if (g_staticParams.options.iFloatPreprocessing < 0 || g_staticParams.options.iFloatPreprocessing > 2)
+   {
+      printf(" Error - float_preprocessing must be 0, 1 or 2 (%d)\n", g_staticParams.options.iFloatPreprocessing);
+      return false;
+   }
 
    return true;
 }
@@ -295,6 +310,34 @@ bool MangoSearchManager::DoSearch()
    if (!InitializeStaticParams())
       return false;
 
+   enzyme_cut_params params;
+   params.semi_tryptic = 0;
+   params.precut_amino = "-";
+   params.prenocut_amino = "-";
+   params.missed_cleavage = 1;
+   params.postcut_amino = "KR";
+   params.postnocut_amino = "P";
+   params.num_threads = g_staticParams.options.iNumThreads;
+
+   // Get actual path of database file; needed for pep.xml output
+   char szFullPathFasta[PATH_MAX];
+   char szFullPathHash[PATH_MAX];
+   realpath(g_staticParams.databaseInfo.szDatabase, szFullPathFasta);
+   realpath(g_staticParams.databaseInfo.szHash, szFullPathHash);
+
+   // Load the peptide hash once; all input files are searched against the same mapped database.
+   // If the hash is not present or is stale, it is generated now.
+   std::chrono::steady_clock::time_point tLoadStart = std::chrono::steady_clock::now();
+   protein_hash_db_t phdp = phd_retrieve_hash_db(szFullPathFasta, params, szFullPathHash);
+   double dLoadTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - tLoadStart).count();
+   printf(" peptide database %s loaded in %0.2f sec\n", szFullPathHash, dLoadTime);
+
+   g_staticParams.dInverseBinWidth = 1.0 /g_staticParams.tolerances.dFragmentBinSize;
+   g_staticParams.dOneMinusBinOffset = 1.0 - g_staticParams.tolerances.dFragmentBinStartOffset;
+
+   // Decoy fragment ions only depend on the fragment bin size so bin them once for all files
+   mango_Search::InitializeDecoyBins();
+
    for (int i=0; i<(int)g_pvInputFiles.size(); i++)
    {
       char szHK1[SIZE_FILE];
@@ -318,16 +361,33 @@ bool MangoSearchManager::DoSearch()
       // This first pass read simply gets all ms/ms scans and their measured precursor m/z
       READ_MZXMLSCANS(szMZXML);
 
-      // Next, go to Hardklor .hk1 file to get accurate precursor m/z
-      READ_HK1(szHK1);
+      // Load both Hardklor files at once; the .hk2 file on a second thread.
+      mango_HardklorFile hkFile1;
+      mango_HardklorFile hkFile2;
 
-      // Now, read through .hk2 file to find accurate peptide masses that add up to precursor
-      READ_HK2(szHK2);
+      // Errors are reported here once both loads are done; exiting from the worker
+      // would tear down the process while this thread is still loading.
+      bool bLoadedHK2 = false;
+      std::thread hk2Thread([&]() { bLoadedHK2 = LOAD_HK(hkFile2, szHK2); });
+      bool bLoadedHK1 = LOAD_HK(hkFile1, szHK1);
+      hk2Thread.join();
 
-      // Load and preprocess all MS/MS scans that have a pair of peptide masses that add up to precursor
-      g_staticParams.dInverseBinWidth = 1.0 /g_staticParams.tolerances.dFragmentBinSize;
-      g_staticParams.dOneMinusBinOffset = 1.0 - g_staticParams.tolerances.dFragmentBinStartOffset;
+      if (!bLoadedHK1 || !bLoadedHK2)
+      {
+         if (!bLoadedHK1)
+            printf(" Error ... cannot create/read %s file.\n", szHK1);
+         if (!bLoadedHK2)
+            printf(" Error ... cannot create/read %s file.\n", szHK2);
+         delete phdp;
+         return false;
+      }
 
+      // Next, go to Hardklor .hk1 file to get accurate precursor m/z
+      READ_HK1(hkFile1, szHK1);
+
+      // Now, read through .hk2 file to find accurate peptide masses that add up to precursor;
+      // this uses the .hk1 precursor masses so the two matching passes stay in order
+      READ_HK2(hkFile2, szHK2);
 
       int iCount=0;
       for (int ii=0; ii<(int)pvSpectrumList.size(); ii++)
@@ -388,408 +448,408 @@ bool MangoSearchManager::DoSearch()
       g_staticParams.options.iEnzymeTermini = ENZYME_DOUBLE_TERMINI;
       g_staticParams.options.bNoEnzymeSelected = false;
 
-      enzyme_cut_params params;
-      params.semi_tryptic = 0;
-      params.precut_amino = "-";
-      params.prenocut_amino = "-";
-      params.missed_cleavage = 1;
-      params.postcut_amino = "KR";
-      params.postnocut_amino = "P";
-
-      // Get actual path of database file; needed for pep.xml output
-      char szFullPathFasta[PATH_MAX];
-      char szFullPathHash[PATH_MAX];
-      realpath(g_staticParams.databaseInfo.szDatabase, szFullPathFasta);
-      realpath(g_staticParams.databaseInfo.szHash, szFullPathHash);
-
-      // Now open fasta file and get a list of all peptides with masses close to
-      mango_Search::SearchForPeptides(szMZXML, szFullPathFasta, params, szFullPathHash);
+      // Now score every relationship against the peptides with masses close to each pair mass
+      mango_Search::SearchForPeptides(szMZXML, szFullPathFasta, phdp);
 
       pvSpectrumList.clear();
 
       printf("\n done: %s\n\n", szMZXML);
    }
 
+   delete phdp;
+
    return 1;
 }
 
 
 void MangoSearchManager::READ_MZXMLSCANS(char *szMZXML)
 {
-   MSReader mstReader;
-   Spectrum mstSpectrum;
-   int iFileLastScan;
+   RAMPFILE *pFI;
+   ramp_fileoffset_t *pScanIndex = NULL;
+   int iFileLastScan = 0;
    int iScanNumber=1;
    int iMS1ScanNumber=0;
 
    printf(" reading %s ... ", szMZXML); fflush(stdout);
 
-   // We want to read only MS1/MS2 scans.
-   vector<MSSpectrumType> msLevel;
-   msLevel.push_back(MS1);
-   msLevel.push_back(MS2);
-   msLevel.push_back(MS3);
+   // Only the MS level, precursor m/z and charge are needed here so read just the
+   // scan headers through the file index; peak lists are not decoded.
+   if ((pFI = rampOpenFile(szMZXML)) != NULL)
+   {
+      ramp_fileoffset_t indexOffset = getIndexOffset(pFI);
 
-   mstReader.setFilter(msLevel);
-   mstReader.readFile(szMZXML, mstSpectrum, 1);
-   iFileLastScan = mstReader.getLastScan();
+      if (indexOffset > 0)
+         pScanIndex = readIndex(pFI, indexOffset, &iFileLastScan);
+   }
 
-   for (iScanNumber = 1 ; iScanNumber <= iFileLastScan; iScanNumber++)
+   if (pScanIndex != NULL)
    {
-      // Loads in MSMS spectrum data.
-      mstReader.readFile(NULL, mstSpectrum, iScanNumber);
+      struct ScanHeaderStruct scanHeader;
 
-      if (mstSpectrum.getMsLevel() == 1)
-      {
-         iMS1ScanNumber = iScanNumber;
-      }
-      else if (mstSpectrum.getMsLevel() == 2)
-      {
-         struct ScanDataStruct pData;
-        
-         if (mstSpectrum.sizeZ() > 0)
-            pData.iPrecursorCharge = mstSpectrum.atZ(0).z;
-         else
-            pData.iPrecursorCharge = 0;
-
-         pData.dPrecursorMZ = mstSpectrum.getMZ();
-         pData.iScanNumber = iScanNumber;
-         pData.iPrecursorScanNumber = iMS1ScanNumber;
-         pData.dHardklorPrecursorNeutralMass = 0.0;
-
-         pvSpectrumList.push_back(pData);
-      }
-      else
+      INIT_SCANINDEX(iFileLastScan);
+
+      for (iScanNumber = 1 ; iScanNumber <= iFileLastScan; iScanNumber++)
       {
-         continue;  // skip any MS3 scans
+         if (pScanIndex[iScanNumber] <= 0)
+            continue;
+
+         readHeader(pFI, pScanIndex[iScanNumber], &scanHeader);
+
+         STORE_SCAN(iScanNumber, scanHeader.msLevel, scanHeader.precursorMZ,
+               (scanHeader.precursorCharge > 0 ? scanHeader.precursorCharge : 0), &iMS1ScanNumber);
+
+         if (!(iScanNumber%200))
+         {
+            printf("%3d%%", (int)(100.0*iScanNumber/iFileLastScan));
+            fflush(stdout);
+            printf("\b\b\b\b");
+         }
       }
 
-      if (!(iScanNumber%200))
+      free(pScanIndex);
+   }
+   else
+   {
+      // No index (or not a RAMP readable file); read every scan through MSReader.
+      MSReader mstReader;
+      Spectrum mstSpectrum;
+
+      // We want to read only MS1/MS2 scans.
+      vector<MSSpectrumType> msLevel;
+      msLevel.push_back(MS1);
+      msLevel.push_back(MS2);
+      msLevel.push_back(MS3);
+
+      mstReader.setFilter(msLevel);
+      mstReader.readFile(szMZXML, mstSpectrum, 1);
+      iFileLastScan = mstReader.getLastScan();
+
+      INIT_SCANINDEX(iFileLastScan);
+
+      for (iScanNumber = 1 ; iScanNumber <= iFileLastScan; iScanNumber++)
       {
-         printf("%3d%%", (int)(100.0*iScanNumber/iFileLastScan));
-         fflush(stdout);
-         printf("\b\b\b\b");
+         // Loads in MSMS spectrum data.
+         mstReader.readFile(NULL, mstSpectrum, iScanNumber);
+
+         STORE_SCAN(iScanNumber, mstSpectrum.getMsLevel(), mstSpectrum.getMZ(),
+               (mstSpectrum.sizeZ() > 0 ? mstSpectrum.atZ(0).z : 0), &iMS1ScanNumber);
+
+         if (!(iScanNumber%200))
+         {
+            printf("%3d%%", (int)(100.0*iScanNumber/iFileLastScan));
+            fflush(stdout);
+            printf("\b\b\b\b");
+         }
       }
    }
 
+   if (pFI != NULL)
+      rampCloseFile(pFI);
+
    printf("100%%\n");
 }
 
 
-void MangoSearchManager::READ_HK1(char *szHK)
+void MangoSearchManager::INIT_SCANINDEX(int iFileLastScan)
 {
-   FILE *fp;
-   char szBuf[SIZE_BUF];
-   int iListCt;       // this will keep an index of pvSpectrumList
-   long lFP = 0;
-   long lEndFP;
+   // scan number -> pvSpectrumList index lookups for the Hardklor readers
+   _viMS1ScanIndex.assign(iFileLastScan+1, -1);
+   _viMS2ScanIndex.assign(iFileLastScan+1, -1);
+}
 
-   printf(" reading %s ... ", szHK); fflush(stdout);
 
-   if ( (fp=fopen(szHK, "r"))== NULL)
+// Adds an MS/MS scan to pvSpectrumList; MS1 scans only update the current
+// precursor scan number and MS3 scans are skipped.
+void MangoSearchManager::STORE_SCAN(int iScanNumber,
+                                    int iMSLevel,
+                                    double dPrecursorMZ,
+                                    int iPrecursorCharge,
+                                    int *piMS1ScanNumber)
+{
+   if (iMSLevel == 1)
    {
-      // Cannot read Hardklor file; try to generate it.
-      GENERATE_HK(szHK);
+      *piMS1ScanNumber = iScanNumber;
+   }
+   else if (iMSLevel == 2)
+   {
+      struct ScanDataStruct pData;
 
-      // Instead of reporting error above, generate HK1 file here.
-      // This requires creating a Hardklor params file and executing hardklor.
+      pData.iPrecursorCharge = iPrecursorCharge;
+      pData.dPrecursorMZ = dPrecursorMZ;
+      pData.iScanNumber = iScanNumber;
+      pData.iPrecursorScanNumber = *piMS1ScanNumber;
+      pData.dHardklorPrecursorNeutralMass = 0.0;
 
-      // run Hardklor
+      // an MS1 scan refers to the first MS/MS scan taken from it
+      if (_viMS1ScanIndex.at(*piMS1ScanNumber) == -1)
+         _viMS1ScanIndex.at(*piMS1ScanNumber) = (int)pvSpectrumList.size();
+      _viMS2ScanIndex.at(iScanNumber) = (int)pvSpectrumList.size();
 
-      // now try to re-open .hk file
-      if ( (fp=fopen(szHK, "r"))== NULL)
-      {
-         printf(" Error ... cannot create/read %s file.\n", szHK);
-         exit(1);
-      }
+      pvSpectrumList.push_back(pData);
    }
+}
 
-   fseek(fp, 0, SEEK_END);
-   lEndFP = ftell(fp);  // store current
-   rewind(fp);
 
-   iListCt = 0;
-   while (fgets(szBuf, SIZE_BUF, fp))
+// Called for the .hk1 and .hk2 files at the same time so must not touch pvSpectrumList
+// or exit; returns false if the file can be neither read nor generated.  A missing
+// file is generated here, so the two Hardklor runs also overlap.
+bool MangoSearchManager::LOAD_HK(mango_HardklorFile &hkFile,
+                                 char *szHK)
+{
+   if (!hkFile.Load(szHK))
    {
-      if (szBuf[0]=='S')
-      {
-         int iScanNumber;
+      // Cannot read Hardklor file; try to generate it.
+      if (!GENERATE_HK(szHK))
+         return false;
 
-         sscanf(szBuf, "S\t%d\t", &iScanNumber);
+      // now try to re-open .hk file
+      if (!hkFile.Load(szHK))
+         return false;
+   }
 
-         while (iListCt < (int)pvSpectrumList.size() && pvSpectrumList.at(iListCt).iPrecursorScanNumber < iScanNumber)
-            iListCt++;
+   return true;
+}
 
-         if (iListCt < (int)pvSpectrumList.size() && pvSpectrumList.at(iListCt).iPrecursorScanNumber == iScanNumber)
-         {
 
-            // Get accurate precursor m/z from deconvoluted MS1 peaks
-            lFP = ftell(fp);  // store current
+void MangoSearchManager::READ_HK1(mango_HardklorFile &hkFile,
+                                  char *szHK)
+{
+   int iListCt;       // this will keep an index of pvSpectrumList
 
-            while (fgets(szBuf, SIZE_BUF, fp))
-            {
-               if (szBuf[0] == 'S')
-               {
-                  fseek(fp, lFP, SEEK_SET);
-                  break;
-               }
+   printf(" reading %s ... ", szHK); fflush(stdout);
 
-               lFP = ftell(fp);
+   int iNumScans = hkFile.GetNumScans();
 
-               if (szBuf[0] == 'P')
-               {
-                  double dMass;
-                  double dMS2PrecursorMass;
-                  int iCharge;
-                  int iIntensity;
+   for (int iWhichScan=0; iWhichScan<iNumScans; iWhichScan++)
+   {
+      const HardklorScan &scan = hkFile.GetScan(iWhichScan);
+      int iScanNumber = scan.iScanNumber;
 
-                  sscanf(szBuf, "P\t%lf\t%d\t%d\t", &dMass, &iCharge, &iIntensity);
+      if (iScanNumber >= 0 && iScanNumber < (int)_viMS1ScanIndex.size()
+            && (iListCt = _viMS1ScanIndex[iScanNumber]) != -1)
+      {
+         // Get accurate precursor m/z from deconvoluted MS1 peaks
+         const HardklorPeak *pPeaks = hkFile.GetPeaks(scan);
 
+         for (int i=0; i<scan.iNumPeaks; i++)
+         {
+            double dMass = pPeaks[i].dNeutralMass;
+            double dMS2PrecursorMass;
+            int iCharge = pPeaks[i].iCharge;
+
+            if (pvSpectrumList.at(iListCt).iPrecursorCharge > 0)
+            {
+               if (iCharge == pvSpectrumList.at(iListCt).iPrecursorCharge)
+               {
+                  dMS2PrecursorMass = pvSpectrumList.at(iListCt).dPrecursorMZ * iCharge - iCharge*PROTON_MASS;
 
-                  if (pvSpectrumList.at(iListCt).iPrecursorCharge > 0)
+                  if (WithinTolerance(dMass, dMS2PrecursorMass, g_staticParams.tolerances.dTolerancePeptide))
                   {
-                     if (iCharge == pvSpectrumList.at(iListCt).iPrecursorCharge)
+                     // if current mass diff is less than stored mass diff
+                     if (fabs(dMass - dMS2PrecursorMass) < fabs(pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass - dMS2PrecursorMass))
                      {
-                        dMS2PrecursorMass = pvSpectrumList.at(iListCt).dPrecursorMZ * iCharge - iCharge*PROTON_MASS;
-
-                        if (WithinTolerance(dMass, dMS2PrecursorMass, g_staticParams.tolerances.dTolerancePeptide))
-                        {
-                           // if current mass diff is less than stored mass diff
-                           if (fabs(dMass - dMS2PrecursorMass) < fabs(pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass - dMS2PrecursorMass))
-                           {
-                              pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass = dMass;
-                           }
-                        }
+                        pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass = dMass;
                      }
                   }
-                  else
-                  {
-                     // we only have an MS2 m/z and no charge.  So need to take hardklor mass + charge,
-                     // apply charge to MS2 m/z and go from there
+               }
+            }
+            else
+            {
+               // we only have an MS2 m/z and no charge.  So need to take hardklor mass + charge,
+               // apply charge to MS2 m/z and go from there
 
-                     dMS2PrecursorMass = pvSpectrumList.at(iListCt).dPrecursorMZ * iCharge - iCharge*PROTON_MASS;
+               dMS2PrecursorMass = pvSpectrumList.at(iListCt).dPrecursorMZ * iCharge - iCharge*PROTON_MASS;
 
-                     if (WithinTolerance(dMass, dMS2PrecursorMass, g_staticParams.tolerances.dTolerancePeptide))
-                     {
-                        // if current mass diff is less than stored mass diff
-                        if (fabs(dMass - dMS2PrecursorMass) < fabs(pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass - dMS2PrecursorMass))
-                        {
-                           pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass = dMass;
-                        }
-                     }
+               if (WithinTolerance(dMass, dMS2PrecursorMass, g_staticParams.tolerances.dTolerancePeptide))
+               {
+                  // if current mass diff is less than stored mass diff
+                  if (fabs(dMass - dMS2PrecursorMass) < fabs(pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass - dMS2PrecursorMass))
+                  {
+                     pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass = dMass;
                   }
                }
             }
          }
-      
-         if (iScanNumber%500)
-         {
-            printf("%3d%%", (int)(100.0*lFP/lEndFP));
-            fflush(stdout);
-            printf("\b\b\b\b");
-         }
+      }
 
+      if (!(iWhichScan%500))
+      {
+         printf("%3d%%", (int)(100.0*iWhichScan/iNumScans));
+         fflush(stdout);
+         printf("\b\b\b\b");
       }
    }
    printf("100%%\n");
-   fclose(fp);
 }
 
 
-void MangoSearchManager::READ_HK2(char *szHK)
+void MangoSearchManager::READ_HK2(mango_HardklorFile &hkFile,
+                                  char *szHK)
 {
-   FILE *fp;
-   char szBuf[SIZE_BUF];
    int iListCt;       // this will keep an index of pvSpectrumList
-   long lFP = 0;
-   long lEndFP;
+   vector<pair<double, int> > vpSortedPeaks;  // (mass, peak index) of one scan
+   vector<int> viPartners;
 
    printf(" reading %s ... ", szHK); fflush(stdout);
 
-   if ( (fp=fopen(szHK, "r"))== NULL)
-   {
-      // Cannot read Hardklor file; try to generate it.
-      GENERATE_HK(szHK);
-
-      // Instead of reporting error above, generate HK1 file here.
-      // This requires creating a Hardklor params file and executing hardklor.
+   int iNumScans = hkFile.GetNumScans();
 
-      // run Hardklor
+   for (int iWhichScan=0; iWhichScan<iNumScans; iWhichScan++)
+   {
+      const HardklorScan &scan = hkFile.GetScan(iWhichScan);
+      int iScanNumber = scan.iScanNumber;
 
-      // now try to re-open .hk file
-      if ( (fp=fopen(szHK, "r"))== NULL)
+      if (iScanNumber >= 0 && iScanNumber < (int)_viMS2ScanIndex.size()
+            && (iListCt = _viMS2ScanIndex[iScanNumber]) != -1)
       {
-         printf(" Error ... cannot create/read %s file.\n", szHK);
-         exit(1);
-      }
-   }
-
-   fseek(fp, 0, SEEK_END);
-   lEndFP = ftell(fp);  // store current
-   rewind(fp);
+         // all deconvoluted peaks in this MS/MS scan
+         const HardklorPeak *pPeaks = hkFile.GetPeaks(scan);
+         int iNumPeaks = scan.iNumPeaks;
 
-   iListCt = 0;
-   while (fgets(szBuf, SIZE_BUF, fp))
-   {
-      if (szBuf[0]=='S')
-      {
-         int iScanNumber;
+         // fallback to using MS2 m/z and charge when no hardklor match
+         if (pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass == 0 && pvSpectrumList.at(iListCt).iPrecursorCharge > 0)
+         {
+             pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass = (pvSpectrumList.at(iListCt).dPrecursorMZ
+                * pvSpectrumList.at(iListCt).iPrecursorCharge)
+                - pvSpectrumList.at(iListCt).iPrecursorCharge*PROTON_MASS;
+         }
 
-         sscanf(szBuf, "S\t%d\t", &iScanNumber);
+         // At this point, we know precursor m/z and precursor charge and have read all ms/ms peaks.
+         // Must find 2 peptides that add up to intact cross-link (ms1+ms2+reporter)
+         // where the charge states of the peptides can't be larger than precursor charge.
+         int i;
+         int ii;
 
-         while (iListCt < (int)pvSpectrumList.size() && pvSpectrumList.at(iListCt).iScanNumber < iScanNumber)
-            iListCt++;
+         double dPrecursorMass = pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass;
+         double dMinPepMass = 600.0+g_staticParams.options.dLysineStumpMass;
+         double dWindow = dPrecursorMass * g_staticParams.tolerances.dToleranceRelationship / 1E6 + 1E-6;
 
-         if (iListCt < (int)pvSpectrumList.size() && pvSpectrumList.at(iListCt).iScanNumber == iScanNumber)
+         // Peaks sorted by mass so the partners of each peak can be found by binary search
+         vpSortedPeaks.clear();
+         for (i=0; i<iNumPeaks; i++)
          {
-            int iNumPeaks=0;
-
-            struct
-            {
-               double dNeutralMass;
-               int iCharge;
-               int iIntensity;
-            } pPeaks[MAX_PEAKS];
-
-            lFP = ftell(fp);  // store current
+            if (pPeaks[i].dNeutralMass >= dMinPepMass)
+               vpSortedPeaks.push_back(make_pair(pPeaks[i].dNeutralMass, i));
+         }
+         sort(vpSortedPeaks.begin(), vpSortedPeaks.end());
 
-            // fallback to using MS2 m/z and charge when no hardklor match
-            if (pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass == 0 && pvSpectrumList.at(iListCt).iPrecursorCharge > 0)
-            {
-                pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass = (pvSpectrumList.at(iListCt).dPrecursorMZ
-                   * pvSpectrumList.at(iListCt).iPrecursorCharge)
-                   - pvSpectrumList.at(iListCt).iPrecursorCharge*PROTON_MASS;
-            }
+         for (i=0; i<iNumPeaks; i++)
+         {
+            // Collect the peaks whose mass completes the precursor for each isotope offset
+            // checked by WithinTolerance.  The window is only a prefilter; pairs are still
+            // tested below and visited in the same (i, ii>=i) order as trying every pair.
+            viPartners.clear();
 
-            // Read in all deconvoluted peaks in this MS/MS scan
-            while (fgets(szBuf, SIZE_BUF, fp))
+            if (pPeaks[i].dNeutralMass >= dMinPepMass)
             {
-               if (szBuf[0] == 'S')
+               for (int iOffset=-2; iOffset<=2; iOffset++)
                {
-                  fseek(fp, lFP, SEEK_SET);
-                  break;
-               }
+                  double dTarget = dPrecursorMass - iOffset*1.003355 - g_staticParams.options.dReporterMass - pPeaks[i].dNeutralMass;
 
-               lFP = ftell(fp);
+                  vector<pair<double, int> >::iterator it = lower_bound(vpSortedPeaks.begin(), vpSortedPeaks.end(),
+                        make_pair(dTarget - dWindow, -1));
 
-               if (szBuf[0] == 'P')
-               {
-                  double dMass;
-                  int iCharge;
-                  int iIntensity;
-
-                  sscanf(szBuf, "P\t%lf\t%d\t%d\t", &dMass, &iCharge, &iIntensity);
-
-                  if (iNumPeaks == MAX_PEAKS)
+                  for ( ; it != vpSortedPeaks.end() && it->first <= dTarget + dWindow; ++it)
                   {
-                     printf(" Error, scan %d has MAX_PEAKS (%d) number of deconvoluted peaks.\n", iScanNumber, MAX_PEAKS);
-                     printf(" Need to increase definition of MAX_PEAKS\n");
-                     exit(1);
+                     if (it->second >= i)
+                        viPartners.push_back(it->second);
                   }
-
-                  pPeaks[iNumPeaks].dNeutralMass = dMass;
-                  pPeaks[iNumPeaks].iCharge = iCharge;
-                  pPeaks[iNumPeaks].iIntensity = iIntensity;
-
-                  iNumPeaks++;
                }
-            }
 
-            // At this point, we know precursor m/z and precursor charge and have read all ms/ms peaks.
-            // Must find 2 peptides that add up to intact cross-link (ms1+ms2+reporter)
-            // where the charge states of the peptides can't be larger than precursor charge.
-            int i;
-            int ii;
+               sort(viPartners.begin(), viPartners.end());
+               viPartners.erase(unique(viPartners.begin(), viPartners.end()), viPartners.end());
+            }
 
-            for (i=0; i<iNumPeaks; i++)
+            for (int iPartner=0; iPartner<(int)viPartners.size(); iPartner++)
             {
-               for (ii=i; ii<iNumPeaks; ii++)
+               ii = viPartners[iPartner];
+
+               // Placing check here that the peptide masses must be greater than some minimum
+               if (pPeaks[i].dNeutralMass >= 600.0+g_staticParams.options.dLysineStumpMass && pPeaks[ii].dNeutralMass >= 600.0+g_staticParams.options.dLysineStumpMass)
                {
-                  // Placing check here that the peptide masses must be greater than some minimum
-                  if (pPeaks[i].dNeutralMass >= 600.0+g_staticParams.options.dLysineStumpMass && pPeaks[ii].dNeutralMass >= 600.0+g_staticParams.options.dLysineStumpMass)
-                  {
-                     double dCombinedMass = pPeaks[i].dNeutralMass + pPeaks[ii].dNeutralMass + g_staticParams.options.dReporterMass;
+                  double dCombinedMass = pPeaks[i].dNeutralMass + pPeaks[ii].dNeutralMass + g_staticParams.options.dReporterMass;
 
 
-                     if (WithinTolerance(dCombinedMass, pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass, g_staticParams.tolerances.dToleranceRelationship))
+                  if (WithinTolerance(dCombinedMass, pvSpectrumList.at(iListCt).dHardklorPrecursorNeutralMass, g_staticParams.tolerances.dToleranceRelationship))
+                  {
+                     if (pPeaks[i].iCharge + pPeaks[ii].iCharge <= pvSpectrumList.at(iListCt).iPrecursorCharge
+                           && pPeaks[i].iCharge < pvSpectrumList.at(iListCt).iPrecursorCharge
+                           && pPeaks[ii].iCharge < pvSpectrumList.at(iListCt).iPrecursorCharge)
                      {
-                        if (pPeaks[i].iCharge + pPeaks[ii].iCharge <= pvSpectrumList.at(iListCt).iPrecursorCharge
-                              && pPeaks[i].iCharge < pvSpectrumList.at(iListCt).iPrecursorCharge
-                              && pPeaks[ii].iCharge < pvSpectrumList.at(iListCt).iPrecursorCharge)
-                        {
-                           struct PrecursorsStruct pTmp;
-                           int a=i;
-                           int b=ii;;
+                        struct PrecursorsStruct pTmp;
+                        int a=i;
+                        int b=ii;;
 
-                           if (pPeaks[i].dNeutralMass > pPeaks[ii].dNeutralMass)
-                           {
-                              a=ii;
-                              b=i;
-                           }
-                           pTmp.dNeutralMass1 = pPeaks[a].dNeutralMass;
-                           pTmp.dNeutralMass2 = pPeaks[b].dNeutralMass;
-                           pTmp.iCharge1 = pPeaks[a].iCharge;
-                           pTmp.iCharge2 = pPeaks[b].iCharge;
-                           pTmp.iIntensity1 = pPeaks[a].iIntensity;
-                           pTmp.iIntensity2 = pPeaks[b].iIntensity;
-
-                           // Do a quick check here and push_back only if the two
-                           // masses are not very similar to existing masses
-                           
-                           bool bMassesAlreadyPresent = false;
-
-                           for (int iii=0; iii<(int)pvSpectrumList.at(iListCt).pvdPrecursors.size(); iii++)
+                        if (pPeaks[i].dNeutralMass > pPeaks[ii].dNeutralMass)
+                        {
+                           a=ii;
+                           b=i;
+                        }
+                        pTmp.dNeutralMass1 = pPeaks[a].dNeutralMass;
+                        pTmp.dNeutralMass2 = pPeaks[b].dNeutralMass;
+                        pTmp.iCharge1 = pPeaks[a].iCharge;
+                        pTmp.iCharge2 = pPeaks[b].iCharge;
+                        pTmp.iIntensity1 = pPeaks[a].iIntensity;
+                        pTmp.iIntensity2 = pPeaks[b].iIntensity;
+
+                        // Do a quick check here and push_back only if the two
+                        // masses are not very similar to existing masses
+                        
+                        bool bMassesAlreadyPresent = false;
+
+                        for (int iii=0; iii<(int)pvSpectrumList.at(iListCt).pvdPrecursors.size(); iii++)
+                        {
+                           if (WithinTolerance(pTmp.dNeutralMass1, pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).dNeutralMass1, g_staticParams.tolerances.dTolerancePeptide)
+                                 && WithinTolerance(pTmp.dNeutralMass2, pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).dNeutralMass2, g_staticParams.tolerances.dTolerancePeptide))
                            {
-                              if (WithinTolerance(pTmp.dNeutralMass1, pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).dNeutralMass1, g_staticParams.tolerances.dTolerancePeptide)
-                                    && WithinTolerance(pTmp.dNeutralMass2, pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).dNeutralMass2, g_staticParams.tolerances.dTolerancePeptide))
-                              {
-                                 bMassesAlreadyPresent = true;
+                              bMassesAlreadyPresent = true;
 
-                                 // Can have same peak in different charge states so store charge state that is most intense
-                                 if (pTmp.iCharge1 != pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iCharge1)
+                              // Can have same peak in different charge states so store charge state that is most intense
+                              if (pTmp.iCharge1 != pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iCharge1)
+                              {
+                                 if (pTmp.iIntensity1 > pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iIntensity1)
                                  {
-                                    if (pTmp.iIntensity1 > pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iIntensity1)
-                                    {
-                                       pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iIntensity1 = pTmp.iIntensity1;
-                                       pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iCharge1 = pTmp.iCharge1;
-                                       pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).dNeutralMass1 = pTmp.dNeutralMass1;
-                                    }
+                                    pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iIntensity1 = pTmp.iIntensity1;
+                                    pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iCharge1 = pTmp.iCharge1;
+                                    pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).dNeutralMass1 = pTmp.dNeutralMass1;
                                  }
-                                 if (pTmp.iCharge2 != pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iCharge2)
+                              }
+                              if (pTmp.iCharge2 != pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iCharge2)
+                              {
+                                 if (pTmp.iIntensity2 > pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iIntensity2)
                                  {
-                                    if (pTmp.iIntensity2 > pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iIntensity2)
-                                    {
-                                       pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iIntensity2 = pTmp.iIntensity2;
-                                       pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iCharge2 = pTmp.iCharge2;
-                                       pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).dNeutralMass2 = pTmp.dNeutralMass2;
-                                    }
+                                    pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iIntensity2 = pTmp.iIntensity2;
+                                    pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).iCharge2 = pTmp.iCharge2;
+                                    pvSpectrumList.at(iListCt).pvdPrecursors.at(iii).dNeutralMass2 = pTmp.dNeutralMass2;
                                  }
-
-                                 break;
                               }
-                           }
 
-                           if (!bMassesAlreadyPresent)
-                              pvSpectrumList.at(iListCt).pvdPrecursors.push_back(pTmp);
+                              break;
+                           }
                         }
+
+                        if (!bMassesAlreadyPresent)
+                           pvSpectrumList.at(iListCt).pvdPrecursors.push_back(pTmp);
                      }
                   }
                }
             }
          }
-      
-         printf("%3d%%", (int)(100.0*lFP/lEndFP));
+      }
+
+      if (!(iWhichScan%500))
+      {
+         printf("%3d%%", (int)(100.0*iWhichScan/iNumScans));
          fflush(stdout);
          printf("\b\b\b\b");
-
       }
    }
    printf("100%%\n");
-   fclose(fp);
 }
 
 
-void MangoSearchManager::GENERATE_HK(char *szHK)
+// Runs from LOAD_HK on a worker thread so errors return false rather than exit.
+bool MangoSearchManager::GENERATE_HK(char *szHK)
 {
    int iResolution;
    int iMSLevel;
@@ -798,6 +858,21 @@ void MangoSearchManager::GENERATE_HK(char *szHK)
    char szConf[SIZE_FILE];
    char szBaseName[SIZE_FILE];
    char szCmd[SIZE_BUF];
+   char szIsotopeData[PATH_MAX];
+   char szHardklorData[PATH_MAX];
+
+   // Hardklor fails quietly on missing data files so check them here; full paths
+   // are written so the .conf files do not depend on the working directory.
+   if (realpath(g_staticParams.options.szHardklorIsotopeData, szIsotopeData) == NULL)
+   {
+      fprintf(stderr, " Error - cannot read hardklor_isotope_data file %s\n", g_staticParams.options.szHardklorIsotopeData);
+      return false;
+   }
+   if (realpath(g_staticParams.options.szHardklorData, szHardklorData) == NULL)
+   {
+      fprintf(stderr, " Error - cannot read hardklor_data file %s\n", g_staticParams.options.szHardklorData);
+      return false;
+   }
 
    strcpy(szBaseName, szHK);
    szBaseName[strlen(szBaseName)-4]='\0';
@@ -825,12 +900,12 @@ void MangoSearchManager::GENERATE_HK(char *szHK)
    if ((fp=fopen(szConf, "w"))==NULL)
    {
       fprintf(stderr, " Error - cannot read or write %s\n", szConf);
-      exit(1);
+      return false;
    }
   
    fprintf(fp, "# Hardkor parameter file\n");
-   fprintf(fp, "isotope_data = /net/pr/vol1/ProteomicsResource/bin/hardklor_files/ISOTOPE.DAT\n");
-   fprintf(fp, "hardklor_data = /net/pr/vol1/ProteomicsResource/bin/hardklor_files/Hardklor.dat\n");
+   fprintf(fp, "isotope_data = %s\n", szIsotopeData);
+   fprintf(fp, "hardklor_data = %s\n", szHardklorData);
    fprintf(fp, "\n");
    fprintf(fp, "\n");
    fprintf(fp, "# Parameters used to described the data being input to Hardklor\n");
@@ -877,9 +952,16 @@ void MangoSearchManager::GENERATE_HK(char *szHK)
 
    fclose(fp);
 
-   printf("\n");
+   // The MS1 and MS2 runs are started from the two LOAD_HK threads and so run
+   // concurrently; print whole lines only.
+   printf(" running hardklor %s\n", szConf);
    sprintf(szCmd, "hardklor %s", szConf);
-   system(szCmd);
+
+   int iRet = system(szCmd);
+   if (iRet != 0)
+      printf(" Warning - \"%s\" returned %d\n", szCmd, iRet);
+
+   return true;
 }
 
 
@@ -20,6 +20,8 @@
 
 using namespace MangoInterfaces;
 
+class mango_HardklorFile;
+
 class MangoSearchManager : public IMangoSearchManager
 {
 public:
@@ -57,12 +59,25 @@ private:
    std::map<std::string, MangoParam*> _mapStaticParams;
 
    void READ_MZXMLSCANS(char *szMZXML);
-   void READ_HK1(char *szHK);
-   void READ_HK2(char *szHK);
-   void GENERATE_HK(char *szHK);
+   void INIT_SCANINDEX(int iFileLastScan);
+   void STORE_SCAN(int iScanNumber,
+                   int iMSLevel,
+                   double dPrecursorMZ,
+                   int iPrecursorCharge,
+                   int *piMS1ScanNumber);
+   bool LOAD_HK(mango_HardklorFile &hkFile,
+                char *szHK);
+   void READ_HK1(mango_HardklorFile &hkFile,
+                 char *szHK);
+   void READ_HK2(mango_HardklorFile &hkFile,
+                 char *szHK);
+   bool GENERATE_HK(char *szHK);
    int WithinTolerance(double dMass1,
                        double dMass2,
                        double dPPM);
+
+   vector<int> _viMS1ScanIndex;  // MS1 scan number -> first pvSpectrumList entry taken from it, or -1
+   vector<int> _viMS2ScanIndex;  // MS2 scan number -> pvSpectrumList entry, or -1
 };
 
 #endif